@@ -218,6 +218,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editconfigdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
+    src/blockencodings.h \
+    src/bloom.h \
     src/blocksizecalculator.h \
     src/allocators.h \
     src/addrman.h \
@@ -250,6 +252,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
+    src/checkqueue.h \
     src/walletdb.h \
     src/script.h \
     src/scrypt.h \
@@ -350,6 +353,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editconfigdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockencodings.cpp \
+    src/bloom.cpp \
     src/blocksizecalculator.cpp \
     src/allocators.cpp \
     src/base58.cpp \
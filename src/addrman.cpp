@@ -3,36 +3,71 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "addrman.h"
-#include "crypto/bmw/bmw512.h"
+#include "hash.h"
 
 using namespace std;
 
+// Bucket selection only has to be unpredictable without nKey, not
+// collision resistant, so it uses SipHash keyed with the first 128 bits of
+// nKey. Each step hashes its own tag first.
+enum
+{
+    ADDRMAN_HASH_TRIED_ADDR = 1,
+    ADDRMAN_HASH_TRIED_GROUP,
+    ADDRMAN_HASH_NEW_GROUP,
+    ADDRMAN_HASH_NEW_SOURCE,
+};
+
+static CSipHasher BucketHasher(const std::vector<unsigned char> &nKey, uint64_t nTag)
+{
+    uint64_t k0 = 0, k1 = 0;
+    assert(nKey.size() >= 2 * sizeof(uint64_t));
+    memcpy(&k0, &nKey[0], sizeof(k0));
+    memcpy(&k1, &nKey[sizeof(k0)], sizeof(k1));
+    CSipHasher hasher(k0, k1);
+    hasher.Write(nTag);
+    return hasher;
+}
+
+// The lengths come first: CSipHasher takes 64-bit words only before any bytes
+static void WriteBytes(CSipHasher &hasher, const std::vector<unsigned char> &vch1, const std::vector<unsigned char> &vch2 = std::vector<unsigned char>())
+{
+    hasher.Write((uint64_t)vch1.size());
+    hasher.Write((uint64_t)vch2.size());
+    if (!vch1.empty())
+        hasher.Write(&vch1[0], vch1.size());
+    if (!vch2.empty())
+        hasher.Write(&vch2[0], vch2.size());
+}
+
 int CAddrInfo::GetTriedBucket(const std::vector<unsigned char> &nKey) const
 {
-    CDataStream ss1(SER_GETHASH, 0);
-    std::vector<unsigned char> vchKey = GetKey();
-    ss1 << nKey << vchKey;
-    uint64_t hash1 = Hash_bmw512(ss1.begin(), ss1.end()).Get64();
-
-    CDataStream ss2(SER_GETHASH, 0);
-    std::vector<unsigned char> vchGroupKey = GetGroup();
-    ss2 << nKey << vchGroupKey << (hash1 % ADDRMAN_TRIED_BUCKETS_PER_GROUP);
-    uint64_t hash2 = Hash_bmw512(ss2.begin(), ss2.end()).Get64();
-    return hash2 % ADDRMAN_TRIED_BUCKET_COUNT;
+    if (nTriedBucket != -1)
+        return nTriedBucket;
+
+    CSipHasher hasher1 = BucketHasher(nKey, ADDRMAN_HASH_TRIED_ADDR);
+    WriteBytes(hasher1, GetKey());
+    uint64_t hash1 = hasher1.Finalize();
+
+    CSipHasher hasher2 = BucketHasher(nKey, ADDRMAN_HASH_TRIED_GROUP);
+    hasher2.Write(hash1 % ADDRMAN_TRIED_BUCKETS_PER_GROUP);
+    WriteBytes(hasher2, GetGroup());
+    nTriedBucket = hasher2.Finalize() % ADDRMAN_TRIED_BUCKET_COUNT;
+    return nTriedBucket;
 }
 
 int CAddrInfo::GetNewBucket(const std::vector<unsigned char> &nKey, const CNetAddr& src) const
 {
-    CDataStream ss1(SER_GETHASH, 0);
-    std::vector<unsigned char> vchGroupKey = GetGroup();
     std::vector<unsigned char> vchSourceGroupKey = src.GetGroup();
-    ss1 << nKey << vchGroupKey << vchSourceGroupKey;
-    uint64_t hash1 = Hash_bmw512(ss1.begin(), ss1.end()).Get64();
 
-    CDataStream ss2(SER_GETHASH, 0);
-    ss2 << nKey << vchSourceGroupKey << (hash1 % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP);
-    uint64_t hash2 = Hash_bmw512(ss2.begin(), ss2.end()).Get64();
-    return hash2 % ADDRMAN_NEW_BUCKET_COUNT;
+    CSipHasher hasher1 = BucketHasher(nKey, ADDRMAN_HASH_NEW_GROUP);
+    WriteBytes(hasher1, GetGroup(), vchSourceGroupKey);
+    uint64_t hash1 = hasher1.Finalize();
+
+    CSipHasher hasher2 = BucketHasher(nKey, ADDRMAN_HASH_NEW_SOURCE);
+    hasher2.Write(hash1 % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP);
+    WriteBytes(hasher2, vchSourceGroupKey);
+    return hasher2.Finalize() % ADDRMAN_NEW_BUCKET_COUNT;
 }
 
 bool CAddrInfo::IsTerrible(int64_t nNow) const
@@ -163,6 +198,7 @@ int CAddrMan::ShrinkNew(int nUBucket)
                 SwapRandom(info.nRandomPos, vRandom.size()-1);
                 vRandom.pop_back();
                 mapAddr.erase(info);
+                setDirty.erase(*it);
                 mapInfo.erase(*it);
                 nNew--;
             }
@@ -192,6 +228,7 @@ int CAddrMan::ShrinkNew(int nUBucket)
         SwapRandom(info.nRandomPos, vRandom.size()-1);
         vRandom.pop_back();
         mapAddr.erase(info);
+        setDirty.erase(nOldest);
         mapInfo.erase(nOldest);
         nNew--;
     }
@@ -219,6 +256,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     std::vector<int> &vTried = vvTried[nKBucket];
 
     // first check whether there is place to just add it
+    setDirty.insert(nId);
     if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
     {
         vTried.push_back(nId);
@@ -239,6 +277,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     CAddrInfo& infoOld = mapInfo[vTried[nPos]];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
+    setDirty.insert(vTried[nPos]);
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
@@ -278,6 +317,7 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
     info.nLastTry = nTime;
     info.nTime = nTime;
     info.nAttempts = 0;
+    setDirty.insert(nId);
 
     // if it is already in the tried set, don't do anything else
     if (info.fInTried)
@@ -325,10 +365,17 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
         if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        {
             pinfo->nTime = max((int64_t)0, addr.nTime - nTimePenalty);
+            setDirty.insert(nId);
+        }
 
         // add services
-        pinfo->nServices |= addr.nServices;
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices)
+        {
+            pinfo->nServices |= addr.nServices;
+            setDirty.insert(nId);
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -353,6 +400,7 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
         pinfo->nTime = max((int64_t)0, (int64_t)pinfo->nTime - nTimePenalty);
         nNew++;
         fNew = true;
+        setDirty.insert(nId);
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
@@ -369,7 +417,8 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
 
 void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
 {
-    CAddrInfo *pinfo = Find(addr);
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -384,6 +433,7 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+    setDirty.insert(nId);
 }
 
 CAddress CAddrMan::Select_(int nUnkBias)
@@ -508,7 +558,8 @@ void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
 
 void CAddrMan::Connected_(const CService &addr, int64_t nTime)
 {
-    CAddrInfo *pinfo = Find(addr);
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -523,5 +574,35 @@ void CAddrMan::Connected_(const CService &addr, int64_t nTime)
     // update info
     int64_t nUpdateInterval = 20 * 60;
     if (nTime - info.nTime > nUpdateInterval)
+    {
         info.nTime = nTime;
+        setDirty.insert(nId);
+    }
+}
+
+void CAddrMan::Apply_(const CAddrJournalEntry &entry)
+{
+    const CAddrInfo &infoIn = entry.info;
+
+    // an address dropped since the snapshot is simply added again
+    if (!Find(infoIn))
+        Add_(infoIn, infoIn.source, 0);
+
+    CAddrInfo *pinfo = Find(infoIn);
+    if (!pinfo || *pinfo != infoIn)
+        return;
+
+    if (entry.fInTried && !pinfo->fInTried)
+        Good_(infoIn, infoIn.nLastSuccess);
+
+    // entries are appended in order, but a stale journal may outlive a newer snapshot
+    CAddrInfo &info = *pinfo;
+    info.nTime = max(info.nTime, infoIn.nTime);
+    info.nServices |= infoIn.nServices;
+    info.nLastSuccess = max(info.nLastSuccess, infoIn.nLastSuccess);
+    if (infoIn.nLastTry >= info.nLastTry)
+    {
+        info.nLastTry = infoIn.nLastTry;
+        info.nAttempts = infoIn.nAttempts;
+    }
 }
@@ -42,6 +42,11 @@ private:
     // position in vRandom
     int nRandomPos;
 
+    // GetTriedBucket and GetNewBucket for the default source, once computed (memory only).
+    // The entries of one CAddrMan all use its key, so these never go stale.
+    mutable int nTriedBucket;
+    mutable int nNewBucket;
+
     friend class CAddrMan;
 
 public:
@@ -62,6 +67,8 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        nTriedBucket = -1;
+        nNewBucket = -1;
     }
 
     CAddrInfo(const CAddress &addrIn, const CNetAddr &addrSource) : CAddress(addrIn), source(addrSource)
@@ -83,7 +90,9 @@ public:
     // Calculate in which "new" bucket this entry belongs, using its default source
     int GetNewBucket(const std::vector<unsigned char> &nKey) const
     {
-        return GetNewBucket(nKey, source);
+        if (nNewBucket == -1)
+            nNewBucket = GetNewBucket(nKey, source);
+        return nNewBucket;
     }
 
     // Determine whether the statistics about this entry are bad enough so that it can just be deleted
@@ -162,6 +171,22 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/** An address that changed since peers.dat was last written, as appended to peers.log */
+class CAddrJournalEntry
+{
+public:
+    CAddrInfo info;
+    bool fInTried;
+
+    CAddrJournalEntry() : fInTried(false) {}
+    CAddrJournalEntry(const CAddrInfo &infoIn, bool fInTriedIn) : info(infoIn), fInTried(fInTriedIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(info);
+        READWRITE(fInTried);
+    )
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -196,6 +221,9 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // nIds changed since the last snapshot or journal append (memory only)
+    std::set<int> setDirty;
+
 protected:
 
     // Find an entry.
@@ -244,6 +272,9 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Bring an entry up to date with a journal entry.
+    void Apply_(const CAddrJournalEntry &entry);
+
 public:
 
 
@@ -258,7 +289,7 @@ public:
     IMPLEMENT_SERIALIZE
     (({
         // serialized format:
-        // * version byte (currently 0)
+        // * version byte (currently 1; 0 used the old bucket hash)
         // * nKey
         // * nNew
         // * nTried
@@ -277,9 +308,12 @@ public:
         //
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
+        //
+        // Changes made after a snapshot are appended to peers.log (see CAddrDB), so writing
+        // one makes the pending changes obsolete.
         {
             LOCK(cs);
-            unsigned char nVersion = 0;
+            unsigned char nVersion = 1;
             READWRITE(nVersion);
             READWRITE(nKey);
             READWRITE(nNew);
@@ -288,6 +322,7 @@ public:
             CAddrMan *am = const_cast<CAddrMan*>(this);
             if (fWrite)
             {
+                am->setDirty.clear();
                 int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
                 READWRITE(nUBuckets);
                 std::map<int, int> mapUnkIds;
@@ -328,10 +363,13 @@ public:
             } else {
                 int nUBuckets = 0;
                 READWRITE(nUBuckets);
+                // buckets from the old hash are rebuilt
+                bool fRebuildNew = (nVersion == 0 || nUBuckets != ADDRMAN_NEW_BUCKET_COUNT);
                 am->nIdCount = 0;
                 am->mapInfo.clear();
                 am->mapAddr.clear();
                 am->vRandom.clear();
+                am->setDirty.clear();
                 am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
                 am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
                 for (int n = 0; n < am->nNew; n++)
@@ -341,7 +379,7 @@ public:
                     am->mapAddr[info] = n;
                     info.nRandomPos = vRandom.size();
                     am->vRandom.push_back(n);
-                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
+                    if (fRebuildNew)
                     {
                         am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
                         info.nRefCount++;
@@ -378,7 +416,7 @@ public:
                         int nIndex = 0;
                         READWRITE(nIndex);
                         CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
+                        if (!fRebuildNew && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
                         {
                             info.nRefCount++;
                             vNew.insert(nIndex);
@@ -508,6 +546,34 @@ public:
             Check();
         }
     }
+
+    // Return the entries changed since the last call or snapshot, and forget them.
+    void TakeChanges(std::vector<CAddrJournalEntry> &vChanges)
+    {
+        LOCK(cs);
+        vChanges.reserve(vChanges.size() + setDirty.size());
+        for (std::set<int>::iterator it = setDirty.begin(); it != setDirty.end(); it++)
+        {
+            assert(mapInfo.count(*it) == 1);
+            const CAddrInfo &info = mapInfo[*it];
+            vChanges.push_back(CAddrJournalEntry(info, info.fInTried));
+        }
+        setDirty.clear();
+    }
+
+    // Replay changes read back from the journal. They are already stored, so they
+    // are not reported by TakeChanges again.
+    void ApplyChanges(const std::vector<CAddrJournalEntry> &vChanges)
+    {
+        {
+            LOCK(cs);
+            Check();
+            for (std::vector<CAddrJournalEntry>::const_iterator it = vChanges.begin(); it != vChanges.end(); it++)
+                Apply_(*it);
+            setDirty.clear();
+            Check();
+        }
+    }
 };
 
 #endif
@@ -0,0 +1,145 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    header(block), nonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header.vtx.clear();
+    FillShortTxIDSelector();
+
+    // The coinbase and coinstake are never in the receiver's memory pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.index = i;
+            prefilled.tx = block.vtx[i];
+            prefilledtxn.push_back(prefilled);
+        }
+        else
+            shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nonce;
+    uint256 hash = ss.GetHash();
+    shorttxidk0 = hash.Get64(0);
+    shorttxidk1 = hash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+
+CPartialBlock::ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_INVALID;
+    if (cmpctblock.BlockTxCount() > MaxCompactBlockTxs())
+        return READ_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vAvailable.assign(cmpctblock.BlockTxCount(), false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+    {
+        if (prefilled.index >= vtx.size() || vAvailable[prefilled.index])
+            return READ_INVALID;
+        vtx[prefilled.index] = prefilled.tx;
+        vAvailable[prefilled.index] = true;
+    }
+
+    // Block index of each short ID
+    map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64_t shortid, cmpctblock.shorttxids)
+    {
+        while (vAvailable[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(shortid, nIndex)).second)
+            return READ_FAILED;
+        nIndex++;
+    }
+
+    // A short ID matched by two pool transactions is requested instead
+    vector<bool> vCollision(vtx.size(), false);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+        {
+            map<uint64_t, unsigned int>::const_iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (mi == mapShortIDs.end() || vCollision[mi->second])
+                continue;
+            if (vAvailable[mi->second])
+            {
+                vtx[mi->second] = CTransaction();
+                vAvailable[mi->second] = false;
+                vCollision[mi->second] = true;
+                continue;
+            }
+            vtx[mi->second] = it->second.GetTx();
+            vAvailable[mi->second] = true;
+        }
+    }
+
+    return READ_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(unsigned int index) const
+{
+    return index < vAvailable.size() && vAvailable[index];
+}
+
+void CPartialBlock::GetMissing(vector<unsigned int>& vMissing) const
+{
+    vMissing.clear();
+    for (unsigned int i = 0; i < vAvailable.size(); i++)
+        if (!vAvailable[i])
+            vMissing.push_back(i);
+}
+
+CPartialBlock::ReadStatus CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing)
+{
+    if (header.IsNull())
+        return READ_INVALID;
+
+    block = header;
+    block.vtx = vtx;
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (vAvailable[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return READ_INVALID;
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_INVALID;
+
+    // A pool transaction matched by a short ID collision gives a block
+    // that doesn't match its header
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_FAILED;
+
+    return READ_OK;
+}
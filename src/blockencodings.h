@@ -0,0 +1,180 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+/** Compact block encoding version announced in "sendcmpct" */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+
+/** Most transactions a compact block or a request for its transactions may list */
+inline unsigned int MaxCompactBlockTxs() { return MAX_BLOCK_SIZE / 60; }
+
+// Transaction indexes are sent as the difference to the previous index plus one
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockTransactionsRequest* pthis = const_cast<CBlockTransactionsRequest*>(this);
+        READWRITE(blockhash);
+        unsigned int nIndexes = indexes.size();
+        READWRITE(VARINT(nIndexes));
+        if (fRead)
+        {
+            if (nIndexes > MaxCompactBlockTxs())
+                throw std::ios_base::failure("CBlockTransactionsRequest : too many indexes");
+            pthis->indexes.resize(nIndexes);
+        }
+        unsigned int nNext = 0;
+        for (unsigned int i = 0; i < nIndexes; i++)
+        {
+            unsigned int nDiff = fRead ? 0 : indexes[i] - nNext;
+            READWRITE(VARINT(nDiff));
+            if (fRead)
+            {
+                if (nDiff > MaxCompactBlockTxs() - nNext)
+                    throw std::ios_base::failure("CBlockTransactionsRequest : index out of range");
+                pthis->indexes[i] = nNext + nDiff;
+            }
+            nNext = indexes[i] + 1;
+        }
+    )
+};
+
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    CBlockTransactions() {}
+    CBlockTransactions(const CBlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+// A transaction sent in full with a compact block, at its index in the block
+class CPrefilledTransaction
+{
+public:
+    unsigned int index;
+    CTransaction tx;
+};
+
+/** A block announced by its header, the short IDs of its transactions and
+ * the transactions the receiver can't have, in the style of BIP 152.
+ * The coinbase and, in proof-of-stake blocks, the coinstake are prefilled.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlock header; // the block without transactions, with its signature
+    uint64_t nonce;
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header);
+        READWRITE(nonce);
+
+        unsigned int nShortIDs = shorttxids.size();
+        READWRITE(VARINT(nShortIDs));
+        if (fRead)
+        {
+            if (nShortIDs > MaxCompactBlockTxs())
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many short IDs");
+            pthis->shorttxids.resize(nShortIDs);
+        }
+        for (unsigned int i = 0; i < nShortIDs; i++)
+        {
+            uint32_t nLow = shorttxids[i] & 0xffffffff;
+            uint16_t nHigh = (shorttxids[i] >> 32) & 0xffff;
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            if (fRead)
+                pthis->shorttxids[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        unsigned int nPrefilled = prefilledtxn.size();
+        READWRITE(VARINT(nPrefilled));
+        if (fRead)
+        {
+            if (nPrefilled > MaxCompactBlockTxs())
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : too many prefilled transactions");
+            pthis->prefilledtxn.resize(nPrefilled);
+        }
+        unsigned int nNext = 0;
+        for (unsigned int i = 0; i < nPrefilled; i++)
+        {
+            unsigned int nDiff = fRead ? 0 : prefilledtxn[i].index - nNext;
+            READWRITE(VARINT(nDiff));
+            if (fRead)
+            {
+                if (nDiff > MaxCompactBlockTxs() - nNext)
+                    throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : prefilled index out of range");
+                pthis->prefilledtxn[i].index = nNext + nDiff;
+            }
+            READWRITE(pthis->prefilledtxn[i].tx);
+            nNext = prefilledtxn[i].index + 1;
+        }
+
+        if (fRead)
+            FillShortTxIDSelector();
+    )
+};
+
+/** A block being rebuilt from a compact block, the memory pool and the
+ * transactions requested with getblocktxn. */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vAvailable;
+
+public:
+    enum ReadStatus
+    {
+        READ_OK,
+        READ_INVALID, // malformed compact block, the peer misbehaved
+        READ_FAILED,  // short ID collision, fetch the full block instead
+    };
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(unsigned int index) const;
+    void GetMissing(std::vector<unsigned int>& vMissing) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing);
+};
+
+#endif
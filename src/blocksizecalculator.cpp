@@ -8,8 +8,138 @@
 using namespace BlockSizeCalculator;
 using namespace std;
 
-static std::vector<unsigned int> blocksizes;
-static bool sorted = false;
+// Sizes of the last pastblocks blocks ending at pindexTip, split into a low
+// and a high half so the median is always at their boundary. Moving the
+// window one block up or down the chain costs O(log n); anything else, such
+// as a jump to another branch, rebuilds it from the block index.
+// nBlocks is fixed, so callers asking for different lengths each get their
+// own window rather than rebuilding a shared one back and forth.
+class CBlockSizeWindow
+{
+private:
+    CBlockIndex* pindexTip;
+    const unsigned int nBlocks;
+    // Blocks in the window, oldest first, with the size each was counted at
+    std::deque<std::pair<CBlockIndex*, int> > vWindow;
+    std::multiset<unsigned int> setLow;
+    std::multiset<unsigned int> setHigh;
+    // Blocks in the window whose size could not be read
+    unsigned int nMissing;
+
+    // Keep setLow the same size as setHigh or one larger
+    void Rebalance()
+    {
+        while (setLow.size() > setHigh.size() + 1) {
+            std::multiset<unsigned int>::iterator it = --setLow.end();
+            setHigh.insert(*it);
+            setLow.erase(it);
+        }
+        while (setHigh.size() > setLow.size()) {
+            setLow.insert(*setHigh.begin());
+            setHigh.erase(setHigh.begin());
+        }
+    }
+
+    void Insert(int nSize)
+    {
+        if (nSize < 0)
+            nMissing++;
+        else if (setLow.empty() || (unsigned int)nSize <= *setLow.rbegin())
+            setLow.insert(nSize);
+        else
+            setHigh.insert(nSize);
+        Rebalance();
+    }
+
+    void Erase(int nSize)
+    {
+        if (nSize < 0) {
+            nMissing--;
+            return;
+        }
+        std::multiset<unsigned int>::iterator it = setLow.find(nSize);
+        if (it != setLow.end())
+            setLow.erase(it);
+        else
+            setHigh.erase(setHigh.find(nSize));
+        Rebalance();
+    }
+
+    void PushBack(CBlockIndex* pindex)
+    {
+        vWindow.push_back(std::make_pair(pindex, GetBlockSize(pindex)));
+        Insert(vWindow.back().second);
+    }
+
+    void PushFront(CBlockIndex* pindex)
+    {
+        vWindow.push_front(std::make_pair(pindex, GetBlockSize(pindex)));
+        Insert(vWindow.front().second);
+    }
+
+    void PopBack()
+    {
+        Erase(vWindow.back().second);
+        vWindow.pop_back();
+    }
+
+    void PopFront()
+    {
+        Erase(vWindow.front().second);
+        vWindow.pop_front();
+    }
+
+    void Rebuild(CBlockIndex* pindex)
+    {
+        vWindow.clear();
+        setLow.clear();
+        setHigh.clear();
+        nMissing = 0;
+        for (unsigned int i = 0; pindex != NULL && i < nBlocks; i++) {
+            PushFront(pindex);
+            pindex = pindex->pprev;
+        }
+    }
+
+public:
+    explicit CBlockSizeWindow(unsigned int nBlocksIn) : pindexTip(NULL), nBlocks(nBlocksIn), nMissing(0) {}
+
+    // Move the window so that it ends at pindex
+    void SetTip(CBlockIndex* pindex)
+    {
+        if (pindex == pindexTip)
+            return;
+
+        if (pindexTip == NULL || vWindow.size() < 2) {
+            Rebuild(pindex);
+        } else if (pindex->pprev == pindexTip) {
+            // Connected on top of the window
+            PushBack(pindex);
+            if (vWindow.size() > nBlocks)
+                PopFront();
+        } else if (pindex == pindexTip->pprev) {
+            // Disconnected the window's tip
+            PopBack();
+            if (vWindow.front().first->pprev != NULL)
+                PushFront(vWindow.front().first->pprev);
+        } else {
+            Rebuild(pindex);
+        }
+        pindexTip = pindex;
+    }
+
+    unsigned int GetMedian() const
+    {
+        if (vWindow.size() != nBlocks || nMissing > 0 || setLow.empty())
+            return 0;
+        if (setLow.size() > setHigh.size())
+            return *setLow.rbegin();
+        return ((uint64_t)*setLow.rbegin() + *setHigh.begin()) / 2;
+    }
+};
+
+// One window per pastblocks value asked for
+static map<unsigned int, CBlockSizeWindow> mapBlockSizeWindows;
 
 unsigned int BlockSizeCalculator::ComputeBlockSize(CBlockIndex *pblockindex, unsigned int pastblocks) {
 
@@ -35,97 +165,46 @@ unsigned int BlockSizeCalculator::ComputeBlockSize(CBlockIndex *pblockindex, uns
 
 }
 
-inline unsigned int BlockSizeCalculator::GetMedianBlockSize(
+unsigned int BlockSizeCalculator::GetMedianBlockSize(
 		CBlockIndex *pblockindex, unsigned int pastblocks) {
 
-	blocksizes = ::GetBlockSizes(pblockindex, pastblocks);
+	AssertLockHeld(cs_main);
 
-	if(!sorted) {
-		std::sort(blocksizes.begin(), blocksizes.end());
-		sorted = true;
-	}
-
-	unsigned int vsize = blocksizes.size();
-	if (vsize == pastblocks) {
-		double median = 0;
-		if ((vsize % 2) == 0) {
-			median = (blocksizes[vsize / 2] + blocksizes[(vsize / 2) - 1]) / 2.0;
-		} else {
-			median = blocksizes[vsize / 2];
-		}
-		return static_cast<unsigned int>(floor(median));
-	} else {
+	if (pblockindex == NULL || pastblocks == 0 || pblockindex->nHeight < (int)pastblocks) {
 		return 0;
 	}
 
-}
-
-inline std::vector<unsigned int> BlockSizeCalculator::GetBlockSizes(
-		CBlockIndex *pblockindex, unsigned int pastblocks) {
-
-	if (pblockindex->nHeight < (int)pastblocks) {
-		return blocksizes;
-	}
-
-	int firstBlock = pblockindex->nHeight - pastblocks;
-
-	if (blocksizes.size() > 0) {
-
-		int latestBlockSize = ::GetBlockSize(pblockindex);
-
-		if (latestBlockSize != -1) {
-
-			CBlockIndex *firstBlockIndex = FindBlockByHeight(firstBlock);
-			int oldestBlockSize = ::GetBlockSize(firstBlockIndex);
-			if (oldestBlockSize != -1) {
-				std::vector<unsigned int>::iterator it;
-				it = std::find(blocksizes.begin(), blocksizes.end(),
-						oldestBlockSize);
-				if (it != blocksizes.end()) {
-					blocksizes.erase(it);
-					it = std::lower_bound(blocksizes.begin(), blocksizes.end(),
-							latestBlockSize);
-					blocksizes.insert(it, latestBlockSize);
-				}
-			}
-
-		}
-
-	} else {
-
-		while (pblockindex != NULL && pblockindex->nHeight > firstBlock) {
-
-			int blocksize = ::GetBlockSize(pblockindex);
-			if (blocksize != -1) {
-
-				blocksizes.push_back(blocksize);
-			}
-
-			pblockindex = pblockindex->pprev;
-		}
-
-	}
-
-	return blocksizes;
+	map<unsigned int, CBlockSizeWindow>::iterator it = mapBlockSizeWindows.find(pastblocks);
+	if (it == mapBlockSizeWindows.end())
+		it = mapBlockSizeWindows.insert(make_pair(pastblocks, CBlockSizeWindow(pastblocks))).first;
+	it->second.SetTip(pblockindex);
+	return it->second.GetMedian();
 
 }
 
-inline int BlockSizeCalculator::GetBlockSize(CBlockIndex *pblockindex) {
+int BlockSizeCalculator::GetBlockSize(CBlockIndex *pblockindex) {
 
 	if (pblockindex == NULL) {
 		return -1;
 	}
 
-	const CDiskBlockPos& pos = pblockindex->GetBlockPos();
-
-	CAutoFile filein(OpenBlockFile(pos, false), SER_DISK, CLIENT_VERSION);
-	FILE* blockFile = filein.release();
-	long int filePos = ftell(blockFile);
-	fseek(blockFile, filePos - sizeof(uint32_t), SEEK_SET);
+	// Blocks loaded from the index are measured once from the size field
+	// that precedes them in the block file
+	if (pblockindex->nBlockSize == 0) {
+		if (pblockindex->nBlockPos < sizeof(uint32_t)) {
+			return -1;
+		}
+		FILE* blockFile = OpenBlockFile(pblockindex->nFile, pblockindex->nBlockPos - sizeof(uint32_t), "rb");
+		if (blockFile == NULL) {
+			return -1;
+		}
+		uint32_t size = 0;
+		if (fread(&size, sizeof(uint32_t), 1, blockFile) == 1) {
+			pblockindex->nBlockSize = size;
+		}
+		fclose(blockFile);
+	}
 
-	uint32_t size = 0;
-	fread(&size, sizeof(uint32_t), 1, blockFile);
-	fclose(blockFile);
-	return (unsigned int) size;
+	return pblockindex->nBlockSize;
 
 }
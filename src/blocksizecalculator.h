@@ -9,6 +9,8 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
 #include <algorithm>
 #include "main.h"
 #include "util.h"
@@ -18,8 +20,7 @@ using namespace std;
 
 namespace BlockSizeCalculator {
     unsigned int ComputeBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline unsigned int GetMedianBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline std::vector<unsigned int> GetBlockSizes(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
-    inline int GetBlockSize(CBlockIndex*);
+    unsigned int GetMedianBlockSize(CBlockIndex*, unsigned int pastblocks = NUM_BLOCKS_FOR_MEDIAN_BLOCK);
+    int GetBlockSize(CBlockIndex*);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "hash.h"
+#include "util.h"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double logFPRate = log(nFPRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5)
+    nHashFuncs = max(1, min((int)(logFPRate / log(0.5) + 0.5), 50));
+    // Insertions per generation; three generations are kept
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    // For nMaxElements insertions into nFilterBits bits with nHashFuncs
+    // hashes each, fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFPRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+// Double hashing: the n-th position is h1 + n * h2 of one 64-bit SipHash
+static inline uint32_t RollingBloomHash(unsigned int n, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return h1 + n * h2;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash, uint64_t nDomain)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe the bits of the generation this one replaces
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    uint64_t nHash = SipHashUint256(nKey0 ^ nDomain, nKey1, hash);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = RollingBloomHash(n, nHash);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // The low bit of pos picks the word within the pair
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash, uint64_t nDomain) const
+{
+    uint64_t nHash = SipHashUint256(nKey0 ^ nDomain, nKey1, hash);
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t h = RollingBloomHash(n, nHash);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // A bit is set if either word of its pair is
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    GetRandBytes((unsigned char*)&nKey0, sizeof(nKey0));
+    GetRandBytes((unsigned char*)&nKey1, sizeof(nKey1));
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
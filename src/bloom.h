@@ -0,0 +1,46 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * A bloom filter that remembers roughly the last nElements insertions, in a
+ * fixed amount of memory whatever the number of insertions.
+ *
+ * Insertions are counted in generations of nElements / 2. Each bit pair of
+ * the filter holds the generation that last set it, and starting a fourth
+ * generation clears the oldest, so between nElements and 1.5 * nElements
+ * of the most recent insertions are contained, with at most nFPRate false
+ * positives.
+ *
+ * Hashes are SipHash with a random key, so peers can't aim false positives.
+ * nDomain separates kinds of hashes, such as inventory types.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash, uint64_t nDomain = 0);
+    bool contains(const uint256& hash, uint64_t nDomain = 0) const;
+
+    // Forget every insertion and pick a new key
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data; // pairs of words: low, then high bits of each bit's generation
+    unsigned int nHashFuncs;
+    uint64_t nKey0, nKey1;
+};
+
+#endif // BITCOIN_BLOOM_H
@@ -56,6 +56,20 @@ typedef u_int SOCKET;
 #define SOCKET_ERROR        -1
 #endif
 
+#ifdef __linux__
+#define USE_EPOLL
+#endif
+
+// Whether select() can watch hSocket; an fd_set only holds descriptors below FD_SETSIZE
+inline bool IsSelectableSocket(SOCKET hSocket)
+{
+#ifdef WIN32
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
 inline int myclosesocket(SOCKET& hSocket)
 {
     if (hSocket == INVALID_SOCKET)
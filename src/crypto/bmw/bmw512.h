@@ -43,6 +43,62 @@ inline uint256 Hash_bmw512(const T1 pbegin, const T1 pend)
     return hash[0].trim256();
 }
 
+/** BMW512 over a fixed prefix followed by a short variable suffix.
+ *  The prefix is absorbed once; each hash copies that state on the stack,
+ *  so no serialization or heap allocation happens per hash. */
+class CBMW512Prefixed
+{
+private:
+    sph_bmw512_context ctxPrefix;
+
+public:
+    CBMW512Prefixed(const void* pprefix, size_t nLen)
+    {
+        sph_bmw512_init(&ctxPrefix);
+        sph_bmw512(&ctxPrefix, pprefix, nLen);
+    }
+
+    uint256 Hash(const void* psuffix, size_t nLen) const
+    {
+        sph_bmw512_context ctx;
+        uint512 hash;
+
+        memcpy(&ctx, &ctxPrefix, sizeof(ctx));
+        sph_bmw512(&ctx, psuffix, nLen);
+        sph_bmw512_close(&ctx, static_cast<void*>(&hash));
+
+        return hash.trim256();
+    }
+};
+
+/** BMW512 over data that arrives in pieces, such as a network message
+ *  hashed as it is received. Finalize gives the same result as
+ *  Hash_bmw512 over the concatenated pieces. */
+class CBMW512
+{
+private:
+    sph_bmw512_context ctx;
+
+public:
+    CBMW512()
+    {
+        sph_bmw512_init(&ctx);
+    }
+
+    CBMW512& Write(const void* pdata, size_t nLen)
+    {
+        sph_bmw512(&ctx, pdata, nLen);
+        return *this;
+    }
+
+    uint256 Finalize()
+    {
+        uint512 hash;
+        sph_bmw512_close(&ctx, static_cast<void*>(&hash));
+        return hash.trim256();
+    }
+};
+
 
 
 
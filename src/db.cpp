@@ -7,6 +7,7 @@
 
 #include "addrman.h"
 #include "hash.h"
+#include "ui_interface.h"
 #include "util.h"
 
 #ifndef WIN32
@@ -49,6 +50,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    nWriteBehind = 0;
 }
 
 CDBEnv::~CDBEnv()
@@ -110,6 +112,9 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
     if (ret != 0)
         return error("CDB() : error %s (%d) opening database environment", DbEnv::strerror(ret), ret);
 
+    // Held writes are committed by the wallet flushing thread
+    nWriteBehind = GetBoolArg("-flushwallet", true) ? std::max((int64_t)0, GetArg("-walletflushinterval", DEFAULT_WALLET_FLUSH_INTERVAL)) : 0;
+
     fDbEnvInit = true;
     fMockDb = false;
 
@@ -231,11 +236,12 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) :
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fWriteBehindIn) :
     pdb(NULL), activeTxn(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    fWriteBehind = fWriteBehindIn && !fReadOnly && bitdb.nWriteBehind > 0;
     if (strFilename.empty())
         return;
 
@@ -303,12 +309,20 @@ void CDB::Close()
     activeTxn = NULL;
     pdb = NULL;
 
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
+    if (fWriteBehind)
+    {
+        // Writes made through are safe once logged; the flushing thread checkpoints
+        bitdb.dbenv.log_flush(NULL);
+    }
+    else
+    {
+        // Flush database activity from memory pool to disk log
+        unsigned int nMinutes = 0;
+        if (fReadOnly)
+            nMinutes = 1;
 
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100)*1024 : 0, nMinutes, 0);
+        bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100)*1024 : 0, nMinutes, 0);
+    }
 
     {
         LOCK(bitdb.cs_db);
@@ -320,6 +334,9 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        // Keep the handle while writes are still queued, so they can be retried
+        if (!FlushWrites(strFile))
+            return;
         if (mapDb[strFile] != NULL)
         {
             // Close the database handle
@@ -331,6 +348,80 @@ void CDBEnv::CloseDb(const string& strFile)
     }
 }
 
+void CDBEnv::QueueWrite(const string& strFile, const CSerializeData& vchKey, const CSerializeData& vchValue)
+{
+    LOCK(cs_db);
+    CDBWriteQueue& queue = mapWriteQueue[strFile];
+    if (queue.mapWrites.empty())
+        queue.nTimeFirst = GetTime();
+    queue.mapWrites[vchKey] = vchValue;
+}
+
+bool CDBEnv::GetQueuedWrite(const string& strFile, const CSerializeData& vchKey, CSerializeData& vchValue)
+{
+    LOCK(cs_db);
+    map<string, CDBWriteQueue>::const_iterator mi = mapWriteQueue.find(strFile);
+    if (mi == mapWriteQueue.end())
+        return false;
+    map<CSerializeData, CSerializeData>::const_iterator it = mi->second.mapWrites.find(vchKey);
+    if (it == mi->second.mapWrites.end())
+        return false;
+    vchValue = it->second;
+    return true;
+}
+
+bool CDBEnv::FlushWrites(const string& strFile, int64_t nMinAge)
+{
+    LOCK(cs_db);
+    map<string, CDBWriteQueue>::iterator mi = mapWriteQueue.find(strFile);
+    if (mi == mapWriteQueue.end())
+        return true;
+    CDBWriteQueue& queue = mi->second;
+    if (nMinAge > 0 && GetTime() - queue.nTimeFirst < nMinAge)
+        return true;
+
+    // Writes are only queued through an open handle, and CloseDb commits them first
+    Db* pdb = mapDb[strFile];
+    if (pdb == NULL)
+        return error("CDBEnv::FlushWrites : %s is not open", strFile);
+
+    int64_t nStart = GetTimeMillis();
+    DbTxn* ptxn = TxnBegin();
+    if (!ptxn)
+        return error("CDBEnv::FlushWrites : failed to begin a transaction on %s", strFile);
+    for (map<CSerializeData, CSerializeData>::iterator it = queue.mapWrites.begin(); it != queue.mapWrites.end(); ++it)
+    {
+        Dbt datKey((void*)&it->first[0], it->first.size());
+        int ret;
+        if (it->second.empty())
+        {
+            ret = pdb->del(ptxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue(&it->second[0], it->second.size());
+            ret = pdb->put(ptxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            ptxn->abort();
+            return error("CDBEnv::FlushWrites : error %s (%d) writing to %s", DbEnv::strerror(ret), ret, strFile);
+        }
+    }
+    int ret = ptxn->commit(0);
+    if (ret != 0)
+        return error("CDBEnv::FlushWrites : error %s (%d) committing to %s", DbEnv::strerror(ret), ret, strFile);
+
+    // The environment commits without syncing, so the group is made durable here at once
+    dbenv.log_flush(NULL);
+
+    LogPrint("db", "Committed %u writes to %s %dms\n", queue.mapWrites.size(), strFile, GetTimeMillis() - nStart);
+    mapWriteQueue.erase(mi);
+    return true;
+}
+
 bool CDBEnv::RemoveDb(const string& strFile)
 {
     this->CloseDb(strFile);
@@ -444,13 +535,16 @@ void CDBEnv::Flush(bool fShutdown)
         return;
     {
         LOCK(cs_db);
+        // Writes that fail to commit stay queued and are retried by the next flush
+        for (map<string, CDBWriteQueue>::iterator it = mapWriteQueue.begin(); it != mapWriteQueue.end(); )
+            FlushWrites((it++)->first);
         map<string, int>::iterator mi = mapFileUseCount.begin();
         while (mi != mapFileUseCount.end())
         {
             string strFile = (*mi).first;
             int nRefCount = (*mi).second;
             LogPrint("db", "%s refcount=%d\n", strFile, nRefCount);
-            if (nRefCount == 0)
+            if (nRefCount == 0 && !mapWriteQueue.count(strFile))
             {
                 // Move log data to the dat file
                 CloseDb(strFile);
@@ -468,6 +562,13 @@ void CDBEnv::Flush(bool fShutdown)
         LogPrint("db", "DBFlush(%s)%s ended %15dms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started", GetTimeMillis() - nStart);
         if (fShutdown)
         {
+            for (map<string, CDBWriteQueue>::iterator it = mapWriteQueue.begin(); it != mapWriteQueue.end(); ++it)
+            {
+                string strMessage = strprintf(_("Error: %u wallet database writes to %s could not be committed and are lost"), it->second.mapWrites.size(), it->first);
+                strMiscWarning = strMessage;
+                LogPrintf("*** %s\n", strMessage);
+                uiInterface.ThreadSafeMessageBox(strMessage, "", CClientUIInterface::MSG_ERROR);
+            }
             char** listp;
             if (mapFileUseCount.empty())
             {
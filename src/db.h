@@ -26,8 +26,22 @@ class CTxIndex;
 
 extern unsigned int nWalletDBUpdated;
 
+/** Default for -walletflushinterval, seconds wallet writes are held to be committed together */
+static const int DEFAULT_WALLET_FLUSH_INTERVAL = 1;
+
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 
+/** Writes to one database file not committed yet, by serialized key */
+class CDBWriteQueue
+{
+public:
+    // An empty value erases the key
+    std::map<CSerializeData, CSerializeData> mapWrites;
+    int64_t nTimeFirst;
+
+    CDBWriteQueue() : nTimeFirst(0) {}
+};
+
 
 class CDBEnv
 {
@@ -44,6 +58,9 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    // Seconds writes through write-behind handles may be held, 0 to write them through
+    int64_t nWriteBehind;
+    std::map<std::string, CDBWriteQueue> mapWriteQueue;
 
     CDBEnv();
     ~CDBEnv();
@@ -76,6 +93,12 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    void QueueWrite(const std::string& strFile, const CSerializeData& vchKey, const CSerializeData& vchValue);
+    // Returns true if vchKey has a queued write; vchValue is left empty for an erase
+    bool GetQueuedWrite(const std::string& strFile, const CSerializeData& vchKey, CSerializeData& vchValue);
+    // Commit the queued writes of strFile in one transaction if the oldest was queued at least nMinAge seconds ago
+    bool FlushWrites(const std::string& strFile, int64_t nMinAge=0);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -97,8 +120,9 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    bool fWriteBehind;
 
-    explicit CDB(const std::string& strFilename, const char* pszMode="r+");
+    explicit CDB(const std::string& strFilename, const char* pszMode="r+", bool fWriteBehindIn=false);
     ~CDB() { Close(); }
 
 public:
@@ -119,6 +143,25 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (fWriteBehind)
+        {
+            CSerializeData vchValue;
+            if (bitdb.GetQueuedWrite(strFile, CSerializeData(ssKey.begin(), ssKey.end()), vchValue))
+            {
+                if (vchValue.empty())
+                    return false;
+                try {
+                    CDataStream ssValue(vchValue, SER_DISK, CLIENT_VERSION);
+                    ssValue >> value;
+                }
+                catch (std::exception &e) {
+                    return false;
+                }
+                return true;
+            }
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -162,6 +205,21 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        // Queue it to be committed with others, unless the caller needs its outcome now
+        if (fWriteBehind && !activeTxn)
+        {
+            if (fOverwrite)
+            {
+                bitdb.QueueWrite(strFile, CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end()));
+                memset(&ssKey[0], 0, ssKey.size());
+                memset(&ssValue[0], 0, ssValue.size());
+                return true;
+            }
+            if (!bitdb.FlushWrites(strFile))
+                return false;
+        }
+
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -185,6 +243,13 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (fWriteBehind && !activeTxn)
+        {
+            bitdb.QueueWrite(strFile, CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData());
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -205,6 +270,14 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (fWriteBehind)
+        {
+            CSerializeData vchValue;
+            if (bitdb.GetQueuedWrite(strFile, CSerializeData(ssKey.begin(), ssKey.end()), vchValue))
+                return !vchValue.empty();
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -219,6 +292,8 @@ protected:
     {
         if (!pdb)
             return NULL;
+        if (fWriteBehind && !bitdb.FlushWrites(strFile))
+            return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
@@ -270,6 +345,8 @@ public:
     {
         if (!pdb || activeTxn)
             return false;
+        if (fWriteBehind && !bitdb.FlushWrites(strFile))
+            return false;
         DbTxn* ptxn = bitdb.TxnBegin();
         if (!ptxn)
             return false;
@@ -295,6 +372,16 @@ public:
         return (ret == 0);
     }
 
+    // Commit the writes this file has queued now. Writes made inside a
+    // transaction bypass the queue and are made durable by TxnCommit, and
+    // flushing from within one would wait on the transaction's own locks.
+    bool FlushWrites()
+    {
+        if (!pdb || !fWriteBehind || activeTxn)
+            return true;
+        return bitdb.FlushWrites(strFile);
+    }
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
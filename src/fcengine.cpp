@@ -73,6 +73,7 @@ void CMNenginePool::SetNull(){
     entries.clear();
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
+    finalTransaction.InvalidateCache();
     lastTimeChanged = GetTimeMillis();
 
     // -- seed random number generator (used for ordering output lists)
@@ -708,6 +709,7 @@ bool CMNenginePool::AddScriptSig(const CTxIn& newVin){
             LogPrint("fcengine", "CMNenginePool::AddScriptSig -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0,24));
         }
     }
+    finalTransaction.InvalidateCache();
     for(unsigned int i = 0; i < entries.size(); i++){
         if(entries[i].AddSig(newVin)){
             LogPrint("fcengine", "CMNenginePool::AddScriptSig -- adding  %s\n", newVin.scriptSig.ToString().substr(0,24));
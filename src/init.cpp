@@ -9,6 +9,7 @@
 #include "main.h"
 #include "chainparams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "key.h"
@@ -56,6 +57,7 @@ bool fConfChange;
 unsigned int nNodeLifespan;
 unsigned int nDerivationMethodIndex;
 unsigned int nMinerSleep;
+unsigned int nStakeThreads;
 bool fUseFastIndex;
 bool fOnlyTor = false;
 
@@ -191,14 +193,20 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: Zalem-Coind.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes, half of which holds unspent outputs (default: 100)") + "\n";
+    strUsage += "  -blockservecache=<n>   " + strprintf(_("Keep up to <n> megabytes of recently requested blocks serialized for peers (0 = off, default: %u)"), DEFAULT_BLOCK_SERVE_CACHE) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 51441)") + "\n";
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
+#ifdef USE_EPOLL
+    strUsage += "  -socketevents=<mode>   " + strprintf(_("Wait for socket events with select or epoll (default: %s)"), DEFAULT_SOCKETEVENTS) + "\n";
+#endif
+    strUsage += "  -msghandlers=<n>       " + strprintf(_("Set the number of threads that answer pings and relay addresses while blocks and transactions are processed (0-%d, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS) + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
@@ -260,6 +268,9 @@ std::string HelpMessage()
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n";
     strUsage += "  -createwalletbackups=<n> " + _("Number of automatic wallet backups (default: 10)") + "\n";
+#ifdef ENABLE_WALLET
+    strUsage += "  -walletflushinterval=<n> " + strprintf(_("Commit wallet database writes together at most <n> seconds after they are made, 0 to write each through (default: %d)"), DEFAULT_WALLET_FLUSH_INTERVAL) + "\n";
+#endif
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 1000) (litemode: 100)") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
@@ -267,6 +278,8 @@ std::string HelpMessage()
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Use <n> megabytes of memory for the signature verification cache (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     strUsage += "  -backtoblock=<n>      " + _("Rollback local block chain to block height <n>") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
@@ -297,6 +310,7 @@ std::string HelpMessage()
         "  -debugsmsg                               " + _("Log extra debug messages.") + "\n" +
         "  -smsgscanchain                           " + _("Scan the block chain for public key addresses on startup.") + "\n";
     strUsage += "  -stakethreshold=<n> " + _("This will set the output size of your stakes to never be below this number (default: 100)") + "\n";
+    strUsage += "  -stakethreads=<n>   " + _("Number of threads searching for a stake kernel (0 = one per core, default: 1)") + "\n";
 
     return strUsage;
 }
@@ -370,6 +384,24 @@ bool AppInit2(boost::thread_group& threadGroup)
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
     nMinerSleep = GetArg("-minersleep", 500);
+    int nStakeThreadsArg = GetArg("-stakethreads", 1);
+    if (nStakeThreadsArg <= 0)
+        nStakeThreadsArg = boost::thread::hardware_concurrency();
+    nStakeThreads = max(nStakeThreadsArg, 1);
+
+    int64_t nBlockServeCacheMB = GetArg("-blockservecache", DEFAULT_BLOCK_SERVE_CACHE);
+    nBlockServeCacheSize = (unsigned int)max(min(nBlockServeCacheMB, (int64_t)1024), (int64_t)0) << 20;
+
+    nMaxMempoolSize = (size_t)max(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE), (int64_t)0) * 1000000;
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
     nDerivationMethodIndex = 0;
 
@@ -536,6 +568,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("Used data directory %s\n", strDataDir);
     std::ostringstream strErrors;
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     if (mapArgs.count("-floatingcitypaymentskey")) // floatingcity payments priv key
     {
         if (!floatingcityPayments.SetPrivKey(GetArg("-floatingcitypaymentskey", "")))
@@ -731,6 +769,31 @@ bool AppInit2(boost::thread_group& threadGroup)
         SetReachable(NET_TOR);
     }
 
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKETEVENTS);
+    if (strSocketEvents == "select")
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+#ifdef USE_EPOLL
+    else if (strSocketEvents == "epoll")
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#endif
+    else
+        return InitError(strprintf(_("Unknown -socketevents mode: '%s'"), strSocketEvents));
+
+    // select() can't watch descriptors beyond FD_SETSIZE; keep some for
+    // listening sockets and the databases
+    nMaxConnections = GetArg("-maxconnections", 125);
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && nMaxConnections > FD_SETSIZE - 64)
+    {
+        nMaxConnections = FD_SETSIZE - 64;
+        LogPrintf("AppInit2 : -maxconnections reduced to %d, the limit of select()\n", nMaxConnections);
+    }
+
+    nMessageHandlerThreads = GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS);
+    if (nMessageHandlerThreads < 0)
+        nMessageHandlerThreads = 0;
+    else if (nMessageHandlerThreads > MAX_MSGHANDLER_THREADS)
+        nMessageHandlerThreads = MAX_MSGHANDLER_THREADS;
+
     // see Step 2: parameter interactions for more information about these
     fNoListen = !GetBoolArg("-listen", true);
     fDiscover = GetBoolArg("-discover", true);
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
@@ -11,6 +12,7 @@
 using namespace std;
 
 extern bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
+extern unsigned int nStakeThreads;
 
 // Get time weight
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
@@ -205,6 +207,24 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
     return Hash_bmw512(ss.begin(), ss.end());
 }
 
+// Lay out the constant part of the kernel exactly as CDataStream would
+// serialize it
+CBMW512Prefixed CStakeKernelHasher::MakePrefix(const uint256& bnStakeModifierV2, unsigned int nTimeTxPrev, const COutPoint& prevout)
+{
+    unsigned char prefix[sizeof(uint256) + sizeof(unsigned int) + sizeof(uint256) + sizeof(unsigned int)];
+    unsigned char* p = prefix;
+
+    memcpy(p, bnStakeModifierV2.begin(), sizeof(uint256));
+    p += sizeof(uint256);
+    memcpy(p, &nTimeTxPrev, sizeof(nTimeTxPrev));
+    p += sizeof(nTimeTxPrev);
+    memcpy(p, prevout.hash.begin(), sizeof(uint256));
+    p += sizeof(uint256);
+    memcpy(p, &prevout.n, sizeof(prevout.n));
+
+    return CBMW512Prefixed(prefix, sizeof(prefix));
+}
+
 // Zalem-Coin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -229,7 +249,12 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 //
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    return CheckStakeKernelHash(pindexPrev, nBits, nTimeBlockFrom, txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -237,7 +262,6 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -249,11 +273,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     int64_t nStakeModifierTime = pindexPrev->nTime;
 
     // Calculate hash
-    CDataStream ss(SER_GETHASH, 0);
-
-    ss << bnStakeModifierV2;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
-    hashProofOfStake = Hash_bmw512(ss.begin(), ss.end());
+    hashProofOfStake = CStakeKernelHasher(bnStakeModifierV2, nTimeTxPrev, prevout).Hash(nTimeTx);
 
     if (fPrintProofOfStake)
     {
@@ -263,7 +283,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -280,7 +300,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -298,26 +318,21 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
 
     // First try finding the previous transaction in database
     CTxDB txdb("r");
-    CTransaction txPrev;
+    CCoins coins;
     CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+    if (!GetCoinsForOutput(txdb, txin.prevout, txindex, coins))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: read txPrev failed"));  // previous transaction not in main chain, may occur during initial download
 
     // Verify signature
-    if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
+    if (!VerifyScript(txin.scriptSig, coins.vout[txin.prevout.n].scriptPubKey, tx, 0, SCRIPT_VERIFY_NONE, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
-
     // Min age requirement
     int nDepth;
     if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
         return tx.DoS(100, error("CheckProofOfStake() : tried to stake at depth %d", nDepth + 1));
 
-    if (!CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(pindexPrev, nBits, coins.nBlockTime, coins.nTime, coins.vout[txin.prevout.n].nValue, txin.prevout, tx.nTime, hashProofOfStake, targetProofOfStake, fDebug))
         return tx.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s", tx.GetHash().ToString(), hashProofOfStake.ToString())); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -334,14 +349,9 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     uint256 hashProofOfStake, targetProofOfStake;
 
     CTxDB txdb("r");
-    CTransaction txPrev;
+    CCoins coins;
     CTxIndex txindex;
-    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
-        return false;
-
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+    if (!GetCoinsForOutput(txdb, prevout, txindex, coins))
         return false;
 
    int nDepth;
@@ -349,7 +359,168 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
        return false;
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = coins.nBlockTime;
+
+    return CheckStakeKernelHash(pindexPrev, nBits, coins.nBlockTime, coins.nTime, coins.vout[prevout.n].nValue, prevout, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate, const uint256& hashBlock)
+{
+    CCoins coins;
+    CTxIndex txindex;
+    if (!GetCoinsForOutput(txdb, prevout, txindex, coins))
+        return false;
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    // Find the block without reading its header, by hash when the caller
+    // knows it and otherwise by the height the coins record
+    CBlockIndex* pindexFrom = NULL;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    if (hashBlock != 0 && mi != mapBlockIndex.end() && (*mi).second->nHeight == coins.nHeight)
+        pindexFrom = (*mi).second;
+    else if (coins.nHeight <= nBestHeight)
+        pindexFrom = FindBlockByHeight(coins.nHeight);
+    if (!pindexFrom || pindexFrom->nFile != txindex.pos.nFile || pindexFrom->nBlockPos != txindex.pos.nBlockPos)
+        return false;
+
+    candidate.prevout = prevout;
+    candidate.nTimeTxPrev = coins.nTime;
+    candidate.nTimeBlockFrom = coins.nBlockTime;
+    candidate.nValue = coins.vout[prevout.n].nValue;
+    candidate.pindexFrom = pindexFrom;
+    return candidate.IsValid();
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate)
+{
+    uint256 hashProofOfStake, targetProofOfStake;
+
+    // Same min depth rule as IsConfirmedInNPrevBlocks(), using the cached height
+    if (!candidate.IsValid() || pindexPrev->nHeight - candidate.pindexFrom->nHeight < nStakeMinConfirmations - 1)
+        return false;
+
+    return CheckStakeKernelHash(pindexPrev, nBits, candidate.nTimeBlockFrom, candidate.nTimeTxPrev, candidate.nValue, candidate.prevout, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+// State shared by the workers of one kernel search
+struct CKernelSearch
+{
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    int64_t nTime;
+    int64_t nSearchInterval;
+    const vector<CStakeCandidate>* pvCandidates;
+    size_t nStart;
+
+    boost::mutex mutex;
+    bool fFound;
+    size_t nKernel;
+    int64_t nTimeKernel;
+
+    // Candidates past a kernel already found need not be checked, those
+    // before it still do so the first kernel from nStart on is returned
+    bool Stopped(size_t nCandidate)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return (fFound && nCandidate > nKernel) || pindexPrev != pindexBest;
+    }
+};
+
+// Check nSearchInterval timestamps back from nTime against one candidate.
+// Target and kernel prefix are set up once, so each timestamp only hashes
+// four more bytes and compares two uint256.
+static bool SearchKernelCandidate(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const CStakeCandidate& candidate, int64_t& nTimeRet)
+{
+    if (!candidate.IsValid() || pindexPrev->nHeight - candidate.pindexFrom->nHeight < nStakeMinConfirmations - 1)
+        return false;
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(candidate.nValue);
+
+    // A weighted target wider than 256 bits is met by every hash
+    bool fAnyHash = bnTarget.bitSize() > 256;
+    uint256 hashTarget = bnTarget.getuint256();
+
+    CStakeKernelHasher hasher(pindexPrev->bnStakeModifierV2, candidate.nTimeTxPrev, candidate.prevout);
+    for (int64_t n = 0; n < nSearchInterval; n++)
+    {
+        if (nTime - n < candidate.nTimeTxPrev)
+            break;  // Transaction timestamp violation
+
+        unsigned int nTimeTx = nTime - n;
+        if (fAnyHash || hasher.Hash(nTimeTx) <= hashTarget)
+        {
+            nTimeRet = nTimeTx;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Worker nWorker of nWorkers checks every nWorkers-th candidate from nStart
+static void ThreadSearchKernel(CKernelSearch* search, size_t nWorker, size_t nWorkers)
+{
+    const vector<CStakeCandidate>& vCandidates = *search->pvCandidates;
+    for (size_t i = search->nStart + nWorker; i < vCandidates.size(); i += nWorkers)
+    {
+        boost::this_thread::interruption_point();
+        if (search->Stopped(i))
+            return;
+
+        // Search backward in time from the given timestamp
+        int64_t nTimeKernel;
+        if (SearchKernelCandidate(search->pindexPrev, search->nBits, search->nTime, search->nSearchInterval, vCandidates[i], nTimeKernel))
+        {
+            boost::mutex::scoped_lock lock(search->mutex);
+            if (!search->fFound || i < search->nKernel)
+            {
+                search->fFound = true;
+                search->nKernel = i;
+                search->nTimeKernel = nTimeKernel;
+            }
+            return;
+        }
+    }
+}
+
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const vector<CStakeCandidate>& vCandidates, size_t nStart, size_t& nKernelRet, int64_t& nTimeRet)
+{
+    if (nStart >= vCandidates.size())
+        return false;
+
+    CKernelSearch search;
+    search.pindexPrev = pindexPrev;
+    search.nBits = nBits;
+    search.nTime = nTime;
+    search.nSearchInterval = nSearchInterval;
+    search.pvCandidates = &vCandidates;
+    search.nStart = nStart;
+    search.fFound = false;
+    search.nKernel = 0;
+    search.nTimeKernel = 0;
+
+    size_t nWorkers = max((size_t)1, min((size_t)nStakeThreads, vCandidates.size() - nStart));
+    if (nWorkers == 1)
+        ThreadSearchKernel(&search, 0, 1);
+    else
+    {
+        boost::thread_group workers;
+        for (size_t i = 0; i < nWorkers; i++)
+            workers.create_thread(boost::bind(&ThreadSearchKernel, &search, i, nWorkers));
+        try {
+            workers.join_all();
+        }
+        catch (boost::thread_interrupted&) {
+            workers.interrupt_all();
+            workers.join_all();
+            throw;
+        }
+    }
+
+    if (!search.fFound)
+        return false;
+
+    nKernelRet = search.nKernel;
+    nTimeRet = search.nTimeKernel;
+    return true;
 }
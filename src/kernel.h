@@ -19,9 +19,30 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& kernel);
 
+// Stake kernel hash of one output for varying nTimeTx:
+//     hash(bnStakeModifierV2 + txPrev.nTime + prevout.hash + prevout.n + nTimeTx)
+// The constant part is absorbed once, each timestamp only hashes 4 bytes
+class CStakeKernelHasher
+{
+private:
+    CBMW512Prefixed hasher;
+
+    static CBMW512Prefixed MakePrefix(const uint256& bnStakeModifierV2, unsigned int nTimeTxPrev, const COutPoint& prevout);
+
+public:
+    CStakeKernelHasher(const uint256& bnStakeModifierV2, unsigned int nTimeTxPrev, const COutPoint& prevout)
+        : hasher(MakePrefix(bnStakeModifierV2, nTimeTxPrev, prevout)) {}
+
+    uint256 Hash(unsigned int nTimeTx) const
+    {
+        return hasher.Hash(&nTimeTx, sizeof(nTimeTx));
+    }
+};
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -38,4 +59,44 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Everything about a stakeable output that the kernel hash depends on,
+// read from disk once so that the kernel search itself needs no I/O
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    unsigned int nTimeTxPrev;
+    unsigned int nTimeBlockFrom;
+    int64_t nValue;
+    CBlockIndex* pindexFrom;
+
+    CStakeCandidate()
+    {
+        nTimeTxPrev = 0;
+        nTimeBlockFrom = 0;
+        nValue = 0;
+        pindexFrom = NULL;
+    }
+
+    // The containing block may have been disconnected by a reorganization
+    bool IsValid() const
+    {
+        return pindexFrom && pindexFrom->IsInMainChain();
+    }
+};
+
+// Read the kernel inputs of prevout from the tx index and block files;
+// hashBlock, when known, is the block holding prevout's transaction
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate, const uint256& hashBlock = 0);
+
+// Same as CheckKernel() but works from a cached candidate, no disk access
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate);
+
+// Search up to nSearchInterval seconds back from nTime for a kernel among
+// vCandidates from index nStart on, split across nStakeThreads workers.
+// Gives up once pindexPrev is no longer the best block. On success returns
+// the index of the first kernel candidate and the timestamp that meets the
+// target, so a caller can resume the search after it.
+bool SearchStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const std::vector<CStakeCandidate>& vCandidates, size_t nStart, size_t& nKernelRet, int64_t& nTimeRet);
+
 #endif // PPCOIN_KERNEL_H
@@ -7,10 +7,12 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksizecalculator.h"
 #include "blockparams.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -32,7 +34,11 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/assign/list_of.hpp>
+
+#include <limits>
+
 using namespace std;
 using namespace boost;
 
@@ -61,6 +67,9 @@ bool fImporting = false;
 bool fReindex = false;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
+unsigned int nBlockServeCacheSize = DEFAULT_BLOCK_SERVE_CACHE << 20;
+size_t nMaxMempoolSize = DEFAULT_MAX_MEMPOOL_SIZE * 1000000;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -102,6 +111,19 @@ struct QueuedBlock {
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+// Headers-first synchronization: the best chain of headers received from
+// peers past the blocks we have, the first one at height nHeaderChainStart.
+// Its blocks are downloaded from all peers that can serve them. Each
+// header's supplier is kept so a branch can be dropped and blamed when it
+// leads to blocks nobody has or that are invalid.
+// Protected by cs_main.
+deque<uint256> vHeaderChain;
+deque<NodeId> vHeaderChainSource;
+map<uint256, int> mapHeaderChainHeight;
+// Peers that answered notfound for a header chain block
+map<uint256, set<NodeId> > mapHeaderNotFound;
+int nHeaderChainStart = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -196,6 +218,18 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // Time of an unanswered getheaders request, 0 if none.
+    int64_t nHeadersRequestTime;
+    // Whether more headers are to be requested once the blocks catch up.
+    bool fHeadersPending;
+    // Height of the last header this peer sent us.
+    int nHeadersHeight;
+    // Height below which this peer last reported a header chain block notfound.
+    int nNotFoundHeight;
+    // Whether the peer should be disconnected without being banned.
+    bool fShouldDisconnect;
+    // Compact blocks from this peer waiting for the transactions we lack.
+    map<uint256, CPartialBlock> mapPartialBlocks;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -204,6 +238,11 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        nHeadersRequestTime = 0;
+        fHeadersPending = false;
+        nHeadersHeight = 0;
+        nNotFoundHeight = std::numeric_limits<int>::max();
+        fShouldDisconnect = false;
     }
 };
 
@@ -232,6 +271,8 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
     state.name = pnode->addrName;
 }
 
+void DropHeaderChain(int nHeight);
+
 void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -242,6 +283,13 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksToDownload.erase(hash);
 
     mapNodeState.erase(nodeid);
+
+    // Nobody is left to vouch for the headers this peer supplied
+    for (unsigned int i = 0; i < vHeaderChainSource.size(); i++)
+        if (vHeaderChainSource[i] == nodeid) {
+            DropHeaderChain(nHeaderChainStart + i);
+            break;
+        }
 }
 
 // Requires cs_main.
@@ -299,6 +347,133 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256 &hash) {
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main. Height of the last header we know of.
+int HeaderChainTip() {
+    return vHeaderChain.empty() ? nBestHeight : nHeaderChainStart + (int)vHeaderChain.size() - 1;
+}
+
+// Requires cs_main. Remove the headers at nHeight and above.
+void TruncateHeaderChain(int nHeight) {
+    while (!vHeaderChain.empty() && HeaderChainTip() >= nHeight) {
+        mapHeaderChainHeight.erase(vHeaderChain.back());
+        mapHeaderNotFound.erase(vHeaderChain.back());
+        vHeaderChain.pop_back();
+        vHeaderChainSource.pop_back();
+    }
+}
+
+// Requires cs_main. Remove the headers of blocks we have from the front.
+void PruneHeaderChain() {
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front())) {
+        mapHeaderChainHeight.erase(vHeaderChain.front());
+        mapHeaderNotFound.erase(vHeaderChain.front());
+        vHeaderChain.pop_front();
+        vHeaderChainSource.pop_front();
+        nHeaderChainStart++;
+    }
+}
+
+// Requires cs_main. Remove the headers at nHeight and above and stop
+// downloading their blocks; peers that sent headers that far are asked
+// for headers again.
+void DropHeaderChain(int nHeight) {
+    if (vHeaderChain.empty() || nHeight > HeaderChainTip())
+        return;
+    LogPrint("net", "dropping header chain from height %d\n", nHeight);
+    for (int i = max(0, nHeight - nHeaderChainStart); i < (int)vHeaderChain.size(); i++)
+        MarkBlockAsReceived(vHeaderChain[i]);
+    TruncateHeaderChain(nHeight);
+    for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+        if (it->second.nHeadersHeight >= nHeight) {
+            it->second.nHeadersHeight = nHeight - 1;
+            it->second.fHeadersPending = true;
+        }
+}
+
+// Requires cs_main. The block of a header chain header is invalid or can't
+// be found: drop the run of headers its supplier gave us that leads to it,
+// and blame the supplier.
+void RejectHeaderChainBlock(const uint256& hash, int nMisbehavior) {
+    map<uint256, int>::iterator mi = mapHeaderChainHeight.find(hash);
+    if (mi == mapHeaderChainHeight.end())
+        return;
+    int i = mi->second - nHeaderChainStart;
+    NodeId nodeSource = vHeaderChainSource[i];
+    while (i > 0 && vHeaderChainSource[i - 1] == nodeSource)
+        i--;
+    LogPrintf("header chain block %s rejected, dropping headers from peer=%d\n", hash.ToString(), nodeSource);
+    DropHeaderChain(nHeaderChainStart + i);
+    if (State(nodeSource) != NULL)
+        Misbehaving(nodeSource, nMisbehavior);
+}
+
+// Requires cs_main. A peer failed to deliver a header chain block, by
+// notfound or by stalling. It isn't asked for the header chain from there
+// on again. A supplier that can't deliver the block behind its own header
+// is disconnected along with its branch; otherwise the branch is dropped
+// once two peers have failed on it. Returns whether the branch is gone.
+bool HeaderChainBlockNotFound(NodeId nodeid, const uint256& hash) {
+    map<uint256, int>::iterator mi = mapHeaderChainHeight.find(hash);
+    if (mi == mapHeaderChainHeight.end())
+        return true;
+    CNodeState *state = State(nodeid);
+    if (state != NULL)
+        state->nNotFoundHeight = min(state->nNotFoundHeight, mi->second);
+
+    set<NodeId>& setNotFound = mapHeaderNotFound[hash];
+    setNotFound.insert(nodeid);
+    if (vHeaderChainSource[mi->second - nHeaderChainStart] == nodeid) {
+        if (state != NULL)
+            state->fShouldDisconnect = true;
+        RejectHeaderChainBlock(hash, 20);
+        return true;
+    }
+    if (setNotFound.size() >= 2) {
+        RejectHeaderChainBlock(hash, 20);
+        return true;
+    }
+    return false;
+}
+
+// Requires cs_main. Ask a peer for the headers following our last one.
+void PushGetHeaders(CNode* pnode) {
+    // Locator of the header chain followed by our best chain
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vHeaderChain.size() - 1; i >= 0; i -= nStep) {
+        vHave.push_back(vHeaderChain[i]);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    for (CBlockIndex* pindex = pindexBest; pindex; ) {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(Params().HashGenesisBlock());
+
+    CNodeState *state = State(pnode->GetId());
+    state->nHeadersRequestTime = GetTime();
+    state->fHeadersPending = false;
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+}
+
+// Requires cs_main. Queue blocks of the header chain for a peer whose chain
+// reaches nPeerHeight, from the BLOCK_DOWNLOAD_WINDOW blocks that follow
+// the last one we have, so one slow peer cannot hold up the others.
+void QueueHeaderChainBlocks(NodeId nodeid, CNodeState &state, int nPeerHeight) {
+    PruneHeaderChain();
+    nPeerHeight = min(nPeerHeight, state.nNotFoundHeight - 1);
+    int nWindow = min((int)vHeaderChain.size(), min(BLOCK_DOWNLOAD_WINDOW, nPeerHeight - nHeaderChainStart + 1));
+    for (int i = 0; i < nWindow && state.nBlocksToDownload + state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++) {
+        const uint256 &hash = vHeaderChain[i];
+        if (!mapOrphanBlocks.count(hash) && !mapBlockIndex.count(hash))
+            AddBlockToQueue(nodeid, hash);
+    }
+}
+
 }
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -871,6 +1046,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -914,7 +1090,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                           error("AcceptToMemoryPool : too many sigops %s, %d > %d",
                                 hash.ToString(), nSigOps, MAX_TX_SIGOPS));
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        int64_t nValueIn = tx.GetValueIn(mapInputs);
+        int64_t nFees = nValueIn-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         // Don't accept it if it can't get into a block
@@ -953,6 +1130,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
             }
         }
 
+        // Once the pool has had to evict, require at least the fee rate it evicted
+        if (!ignoreFees)
+        {
+            int64_t nMempoolMinFee = pool.GetMinFee(nMaxMempoolSize);
+            if (nMempoolMinFee > 0 && nFees < nMempoolMinFee * nSize / 1000)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                            hash.ToString(),
+                            nFees, nMempoolMinFee * nSize / 1000);
+        }
+
         if (fRejectInsaneFee && nFees > MIN_RELAY_TX_FEE * 10000)
             return error("AcceptableInputs: : insane fees %s, %d > %d",
                          hash.ToString(),
@@ -978,10 +1165,32 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Priority is sum(valuein * age) / txsize over inputs already in the chain,
+        // computed once here so block assembly does not read the inputs again
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CCoins& coins = mapInputs[txin.prevout.hash].second;
+            if (coins.nHeight == MEMPOOL_HEIGHT)
+                continue; // spends a memory pool transaction
+            int64_t nValue = coins.vout[txin.prevout.n].nValue;
+            nValueInChain += nValue;
+            dPriority += (double)nValue * (1 + nBestHeight - coins.nHeight);
+        }
+        dPriority /= nSize;
+
+        entry = CTxMemPoolEntry(tx, nFees, nValueIn, nValueInChain, dPriority, nBestHeight, GetTime());
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    // Stay below -maxmempool, which may evict this very transaction
+    pool.TrimToSize(nMaxMempoolSize);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full %s", hash.ToString());
     setValidatedTx.insert(hash);
 
     SyncWithWallets(tx, NULL, true, fFixSpentCoins);
@@ -1318,6 +1527,34 @@ int CTxIndex::GetDepthInMainChain() const
     return 1 + nBestHeight - pindex->nHeight;
 }
 
+bool CCoins::ReadFromDisk(const CTxIndex& txindex)
+{
+    CTransaction tx;
+    if (!tx.ReadFromDisk(txindex.pos))
+        return false;
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    // Find the block in the index
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return false;
+    *this = CCoins(tx, (*mi).second->nHeight, block.nTime);
+    return true;
+}
+
+// Return the coins of the transaction prevout points to, with the output
+// itself available even if it has been spent since
+bool GetCoinsForOutput(CTxDB& txdb, const COutPoint& prevout, CTxIndex& txindexRet, CCoins& coinsRet)
+{
+    if (!txdb.ReadTxIndex(prevout.hash, txindexRet))
+        return false;
+    if (txdb.ReadCoins(prevout.hash, coinsRet) && coinsRet.IsAvailable(prevout.n))
+        return true;
+    return coinsRet.ReadFromDisk(txindexRet) && prevout.n < coinsRet.vout.size();
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
@@ -1551,6 +1788,14 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             // Write back
             if (!txdb.UpdateTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : UpdateTxIndex failed");
+
+            // The output may have been pruned from the coins, so rebuild them
+            CCoins coins;
+            if (!coins.ReadFromDisk(txindex))
+                return error("DisconnectInputs() : ReadFromDisk prev tx %s failed", prevout.hash.ToString());
+            coins.Spend(txindex);
+            if (!txdb.WriteCoins(prevout.hash, coins))
+                return error("DisconnectInputs() : WriteCoins failed");
         }
     }
 
@@ -1559,6 +1804,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
     // reorganized away. This is only possible if this transaction was completely
     // spent, so erasing it would be a no-op anyway.
     txdb.EraseTxIndex(*this);
+    txdb.EraseCoins(GetHash());
 
     return true;
 }
@@ -1598,20 +1844,22 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (!fFound && (fBlock || fMiner))
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(),  prevout.hash.ToString());
 
-        // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        // Read the coins of txPrev
+        CCoins& coins = inputsRet[prevout.hash].second;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
+            CTransaction txPrev;
             if (!mempool.lookup(prevout.hash, txPrev))
                 return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString(),  prevout.hash.ToString());
+            coins = CCoins(txPrev, MEMPOOL_HEIGHT, 0);
             if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
+                txindex.vSpent.resize(coins.vout.size());
         }
-        else
+        else if (!txdb.ReadCoins(prevout.hash, coins))
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            // Fully spent transactions have no coins record
+            if (!coins.ReadFromDisk(txindex))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
         }
     }
@@ -1622,13 +1870,21 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
         const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+        CCoins& coins = inputsRet[prevout.hash].second;
+        if (prevout.n >= coins.vout.size() || prevout.n >= txindex.vSpent.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
             // adding inputs:
             fInvalid = true;
-            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coins.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coins.ToString()));
+        }
+
+        // The txindex decides what is spent; a record that disagrees is stale
+        if (!coins.IsAvailable(prevout.n) && txindex.vSpent[prevout.n].IsNull())
+        {
+            LogPrintf("FetchInputs() : coins of %s out of date, reading from disk\n", prevout.hash.ToString());
+            if (!coins.ReadFromDisk(txindex))
+                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(),  prevout.hash.ToString());
         }
     }
 
@@ -1641,11 +1897,11 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
-    if (input.prevout.n >= txPrev.vout.size())
+    const CCoins& coins = (mi->second).second;
+    if (input.prevout.n >= coins.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
-    return txPrev.vout[input.prevout.n];
+    return coins.vout[input.prevout.n];
 }
 
 int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
@@ -1662,8 +1918,22 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, 0))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("zalem-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1678,29 +1948,36 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            const CCoins& coins = inputs[prevout.hash].second;
+
+            if (prevout.n >= coins.vout.size() || prevout.n >= txindex.vSpent.size())
+                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coins.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coins.ToString()));
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+            // Check for conflicts (double-spend) before looking at the output,
+            // which the coins have already pruned if it is spent.
+            // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
+            // for an attacker to attempt to split the network.
+            if (!txindex.vSpent[prevout.n].IsNull())
+                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString(), txindex.vSpent[prevout.n].ToString());
 
             // If prev is coinbase or coinstake, check that it's matured
-            if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
+            if (coins.IsCoinBase() || coins.IsCoinStake())
             {
                 int nSpendDepth;
                 if (IsConfirmedInNPrevBlocks(txindex, pindexBlock, nCoinbaseMaturity, nSpendDepth))
-                    return error("ConnectInputs() : tried to spend %s at depth %d", txPrev.IsCoinBase() ? "coinbase" : "coinstake", nSpendDepth);
+                    return error("ConnectInputs() : tried to spend %s at depth %d", coins.IsCoinBase() ? "coinbase" : "coinstake", nSpendDepth);
             }
 
             // ppcoin: check transaction timestamp
-            if (txPrev.nTime > nTime)
+            if (coins.nTime > nTime)
                 return DoS(100, error("ConnectInputs() : transaction timestamp earlier than input transaction"));
 
-            if (txPrev.vout[prevout.n].IsEmpty())
+            if (coins.vout[prevout.n].IsEmpty())
                 return DoS(1, error("ConnectInputs() : special marker is not spendable"));
 
             // Check for negative or overflow input values
-            nValueIn += txPrev.vout[prevout.n].nValue;
-            if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coins.vout[prevout.n].nValue;
+            if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return DoS(100, error("ConnectInputs() : txin values out of range"));
 
         }
@@ -1712,13 +1989,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
             CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
-
-            // Check for conflicts (double-spend)
-            // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
-            // for an attacker to attempt to split the network.
-            if (!txindex.vSpent[prevout.n].IsNull())
-                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString(), txindex.vSpent[prevout.n].ToString());
+            const CCoins& coins = inputs[prevout.hash].second;
 
             if(fValidateSig)
             {
@@ -1727,8 +1998,10 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (!(fBlock && !IsInitialBlockDownload()))
                 {
-                    // Verify signature
-                    if (!VerifySignature(txPrev, *this, i, flags, 0))
+                    // Verify signature, or leave it to the caller's check queue
+                    if (pvChecks)
+                        pvChecks->push_back(CScriptCheck(coins, *this, i, flags));
+                    else if (!VerifyScript(vin[i].scriptSig, coins.vout[prevout.n].scriptPubKey, *this, i, flags, 0))
                     {
                         if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                             // Check whether the failure was caused by a
@@ -1737,7 +2010,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                             // if so, don't trigger DoS protection to
                             // avoid splitting the network between upgraded and
                             // non-upgraded nodes.
-                            if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                            if (VerifyScript(vin[i].scriptSig, coins.vout[prevout.n].scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
                                 return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
                         }
                         // Failures of other flags indicate a transaction that is
@@ -1882,7 +2155,11 @@ void CBlock::RebuildAddressIndex(CTxDB& txdb)
             MapPrevTx::const_iterator mi;
             for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
             {
-                BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
+                // The coins no longer hold spent outputs; index all of them
+                CTransaction txPrev;
+                if (!txdb.ReadDiskTx((*mi).first, txPrev))
+                    continue;
+                BOOST_FOREACH(const CTxOut &atxout, txPrev.vout)
                 {
                     std::vector<uint160> addrIds;
                     if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
@@ -1929,6 +2206,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    map<uint256, CCoins> mapQueuedCoins;
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1958,6 +2237,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             nValueOut += tx.GetValueOut();
         else
         {
+            // Inputs created or touched earlier in this block come from the queue
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                map<uint256, CCoins>::iterator mi = mapQueuedCoins.find(txin.prevout.hash);
+                if (mi != mapQueuedCoins.end())
+                    mapInputs[mi->first] = make_pair(mapQueuedChanges[mi->first], mi->second);
+            }
+
             bool fInvalid;
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
@@ -1979,13 +2266,28 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 nStakeReward = nTxValueOut - nTxValueIn;
 
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
+
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                map<uint256, CCoins>::iterator mi = mapQueuedCoins.find(txin.prevout.hash);
+                if (mi == mapQueuedCoins.end())
+                    mi = mapQueuedCoins.insert(make_pair(txin.prevout.hash, mapInputs[txin.prevout.hash].second)).first;
+                mi->second.Spend(txin.prevout.n);
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        mapQueuedCoins[hashTx] = CCoins(tx, pindex->nHeight, pindex->nTime);
     }
 
+    // Nothing is written before every queued script check has passed
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : one of the input signatures is invalid"));
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -2024,6 +2326,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Write queued coins changes, dropping the records of spent transactions
+    for (map<uint256, CCoins>::iterator mi = mapQueuedCoins.begin(); mi != mapQueuedCoins.end(); ++mi)
+    {
+        CCoins& coins = (*mi).second;
+        coins.Spend(mapQueuedChanges[(*mi).first]);
+        if (coins.IsPruned() ? !txdb.EraseCoins((*mi).first) : !txdb.WriteCoins((*mi).first, coins))
+            return error("ConnectBlock() : WriteCoins failed");
+    }
+
     if(GetBoolArg("-addrindex", false))
     {
         // Write Address Index
@@ -2042,7 +2353,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 MapPrevTx::const_iterator mi;
                 for(MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
                 {
-                    BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
+                    // The coins no longer hold spent outputs; index all of them
+                    CTransaction txPrev;
+                    if (!txdb.ReadDiskTx((*mi).first, txPrev))
+                        continue;
+                    BOOST_FOREACH(const CTxOut &atxout, txPrev.vout)
                     {
                         std::vector<uint160> addrIds;
                         if(BuildAddrIndex(atxout.scriptPubKey, addrIds))
@@ -2141,7 +2456,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<pair<CTransaction, int> > vDelete;
     for (unsigned int i = 0; i < vConnect.size(); i++)
     {
         CBlockIndex* pindex = vConnect[i];
@@ -2156,7 +2471,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Queue memory transactions to delete
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+            vDelete.push_back(make_pair(tx, pindex->nHeight));
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -2180,9 +2495,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
+    for (unsigned int i = 0; i < vDelete.size(); i++) {
+        mempool.removeConfirmed(vDelete[i].first, vDelete[i].second);
+        mempool.removeConflicts(vDelete[i].first);
     }
 
     LogPrintf("REORGANIZE: done\n");
@@ -2211,7 +2526,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+        mempool.removeConfirmed(tx, pindexNew->nHeight);
 
     return true;
 }
@@ -2353,11 +2668,11 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
         // First try finding the previous transaction in database
-        CTransaction txPrev;
+        CCoins coins;
         CTxIndex txindex;
-        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        if (!GetCoinsForOutput(txdb, txin.prevout, txindex, coins))
             continue;  // previous transaction not in main chain
-        if (nTime < txPrev.nTime)
+        if (nTime < coins.nTime)
             return false;  // Transaction timestamp violation
 
         int nSpendDepth;
@@ -2367,10 +2682,10 @@ bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64
             continue; // only count coins meeting min confirmations requirement
         }
 
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        bnCentSecond += CBigNum(nValueIn) * (nTime-txPrev.nTime) / CENT;
+        int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
+        bnCentSecond += CBigNum(nValueIn) * (nTime-coins.nTime) / CENT;
 
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - txPrev.nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, nTime - coins.nTime, bnCentSecond.ToString());
     }
 
     CBigNum bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
@@ -2814,10 +3129,29 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for compact blocks get one right away instead of an inv
+        CInv inv(MSG_BLOCK, hash);
+        CSerializeDataPtr pmsgCompact;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fSendCompactBlocks)
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->filterInventoryKnown.contains(inv.hash, inv.type))
+                    continue;
+                pnode->filterInventoryKnown.insert(inv.hash, inv.type);
+            }
+            if (!pmsgCompact)
+                pmsgCompact = SerializeMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*this));
+            pnode->PushSerializedMessage("cmpctblock", pmsgCompact);
+        }
     }
 
     return true;
@@ -2873,7 +3207,7 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name.c_str(), state->nMisbehavior-howmuch, state->nMisbehavior);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked)
 {
     AssertLockHeld(cs_main);
 
@@ -2909,8 +3243,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock(): bad block signature encoding");
     }
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
+    // Preliminary checks, less those an importer checked in parallel
+    if (!pblock->CheckBlock(!fPrechecked, !fPrechecked, !fPrechecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
@@ -2943,12 +3277,16 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
-            if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            // Ask this guy to fill in what we're missing, unless the
+            // parents are downloaded along the header chain anyway
+            if (!mapHeaderChainHeight.count(hash))
+            {
+                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
+                // ppcoin: getblocks may not obtain the ancestor block rejected
+                // earlier by duplicate-stake check so we ask for it again directly
+                if (!IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+            }
         }
         return true;
     }
@@ -3058,6 +3396,7 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
                 // make sure coinstake would meet timestamp protocol
                 //    as it would be the same as the block timestamp
                 vtx[0].nTime = nTime = txCoinStake.nTime;
+                vtx[0].InvalidateCache();
 
                 // we have to make sure that we have no future timestamps in
                 //    our transactions set
@@ -3145,6 +3484,31 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// Append the block at pindex to ssBlock exactly as it is stored, which is
+// also its network serialization, using the size written ahead of it.
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex)
+{
+    if (pindex->nBlockPos < sizeof(unsigned int))
+        return error("ReadRawBlockFromDisk() : bad block position");
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(unsigned int), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+
+    try {
+        unsigned int nSize = 0;
+        filein >> nSize;
+        if (nSize < 80 || nSize > MAX_SIZE)
+            return error("ReadRawBlockFromDisk() : bad block size %u", nSize);
+        unsigned int nOffset = ssBlock.size();
+        ssBlock.resize(nOffset + nSize);
+        filein.read((char*)&ssBlock[nOffset], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -3275,64 +3639,229 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+// Blocks read from an external file, handed from the reader thread to the
+// check threads and on, in file order, to LoadExternalBlockFile.
+class CBlockFileImport
 {
-    int64_t nStart = GetTimeMillis();
+public:
+    // Most blocks read ahead of the one being connected
+    static const unsigned int MAX_BLOCKS_AHEAD = 1024;
 
-    int nLoaded = 0;
+    struct CImportBlock
     {
+        CBlock block;
+        bool fValid;      // deserialized
+        bool fPrechecked; // passed the context-free checks of CheckBlock
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<unsigned int, std::vector<char> > > queueRead;
+    std::map<unsigned int, boost::shared_ptr<CImportBlock> > mapChecked;
+    unsigned int nRead;      // blocks found so far
+    unsigned int nConnected; // blocks taken by the connector so far
+    bool fReadDone;
+    // MAX_BLOCK_SIZE when the import started; the connecting thread updates
+    // the global as it goes, so the reader must not read it
+    const unsigned int nMaxBlockSize;
+
+    CBlockFileImport() : nRead(0), nConnected(0), fReadDone(false), nMaxBlockSize(MAX_BLOCK_SIZE) {}
+
+    // Locate blocks by their message start and size, as written by the
+    // block files and linearize scripts, and queue their bytes
+    void ThreadRead(FILE* fileIn)
+    {
+        // Read in big chunks, so the buffered bytes are moved down rarely
+        static const unsigned int READ_CHUNK = 16 << 20;
+        std::vector<char> vBuf;
+        size_t nBufPos = 0;
+        bool fEOF = false;
+
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            while (true)
             {
                 boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
+
+                // Keep at least a header and the largest possible block buffered
+                if (!fEOF && vBuf.size() - nBufPos < MESSAGE_START_SIZE + 4 + nMaxBlockSize)
+                {
+                    vBuf.erase(vBuf.begin(), vBuf.begin() + nBufPos);
+                    nBufPos = 0;
+                    size_t nSize = vBuf.size();
+                    vBuf.resize(nSize + READ_CHUNK);
+                    size_t nGot = fread(&vBuf[nSize], 1, READ_CHUNK, fileIn);
+                    vBuf.resize(nSize + nGot);
+                    if (nGot < READ_CHUNK)
+                        fEOF = true;
+                    continue;
+                }
+
+                size_t nAvail = vBuf.size() - nBufPos;
+                if (nAvail < MESSAGE_START_SIZE + 4)
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                const char* pchStart = &vBuf[nBufPos];
+                const char* pchFind = (const char*)memchr(pchStart, Params().MessageStart()[0], nAvail + 1 - MESSAGE_START_SIZE);
+                if (!pchFind)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                    nBufPos += nAvail + 1 - MESSAGE_START_SIZE;
+                    continue;
+                }
+                nBufPos += pchFind - pchStart;
+                if (memcmp(pchFind, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+                {
+                    nBufPos++;
+                    continue;
                 }
+                nBufPos += MESSAGE_START_SIZE;
+
+                unsigned int nSize = 0;
+                memcpy(&nSize, &vBuf[nBufPos], sizeof(nSize));
+                if (nSize == 0 || nSize > nMaxBlockSize || nSize > vBuf.size() - nBufPos - 4)
+                    continue;
+                nBufPos += 4;
+
+                std::vector<char> vchBlock(vBuf.begin() + nBufPos, vBuf.begin() + nBufPos + nSize);
+                nBufPos += nSize;
+
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nRead - nConnected >= MAX_BLOCKS_AHEAD)
+                    cond.wait(lock);
+                queueRead.push_back(std::make_pair(nRead++, std::vector<char>()));
+                queueRead.back().second.swap(vchBlock);
+                cond.notify_all();
             }
         }
+        catch (boost::thread_interrupted&) {
+            throw;
+        }
         catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            LogPrintf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        cond.notify_all();
+    }
+
+    // Deserialize blocks and run the checks of CheckBlock that need no
+    // chain state: proof of work, merkle root and block signature
+    void ThreadCheck()
+    {
+        while (true)
+        {
+            std::pair<unsigned int, std::vector<char> > item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRead.empty() && !fReadDone)
+                    cond.wait(lock);
+                if (queueRead.empty())
+                    return;
+                item.first = queueRead.front().first;
+                item.second.swap(queueRead.front().second);
+                queueRead.pop_front();
+            }
+
+            boost::shared_ptr<CImportBlock> pimport(new CImportBlock());
+            CBlock& block = pimport->block;
+            try {
+                CDataStream ss(item.second, SER_DISK, CLIENT_VERSION);
+                ss >> block;
+                pimport->fValid = true;
+            }
+            catch (std::exception &e) {
+                pimport->fValid = false;
+            }
+            pimport->fPrechecked = pimport->fValid &&
+                (!block.IsProofOfWork() || CheckProofOfWork(block.GetPoWHash(), block.nBits)) &&
+                !block.vtx.empty() && block.hashMerkleRoot == block.BuildMerkleTree() &&
+                block.CheckBlockSignature();
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapChecked[item.first] = pimport;
+            cond.notify_all();
+        }
+    }
+
+    // The next block in file order, or NULL once the file is done
+    boost::shared_ptr<CImportBlock> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true)
+        {
+            std::map<unsigned int, boost::shared_ptr<CImportBlock> >::iterator it = mapChecked.find(nConnected);
+            if (it != mapChecked.end())
+            {
+                boost::shared_ptr<CImportBlock> pimport = it->second;
+                mapChecked.erase(it);
+                nConnected++;
+                cond.notify_all();
+                return pimport;
+            }
+            if (fReadDone && nConnected == nRead)
+                return boost::shared_ptr<CImportBlock>();
+            cond.wait(lock);
         }
     }
+};
+
+// Interrupts and joins the import threads however LoadExternalBlockFile
+// returns, before the CBlockFileImport they use goes away
+struct CImportThreads
+{
+    boost::thread_group threads;
+
+    ~CImportThreads() {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64_t nStart = GetTimeMillis();
+
+    // A reader thread finds the blocks and -par threads check them, while
+    // this thread connects them in file order
+    CBlockFileImport import;
+    int nLoaded = 0;
+    try {
+        CImportThreads importThreads;
+        importThreads.threads.create_thread(boost::bind(&CBlockFileImport::ThreadRead, &import, fileIn));
+        int nCheckThreads = max(nScriptCheckThreads, 1);
+        for (int i = 0; i < nCheckThreads; i++)
+            importThreads.threads.create_thread(boost::bind(&CBlockFileImport::ThreadCheck, &import));
+
+        while (true)
+        {
+            boost::this_thread::interruption_point();
+            boost::shared_ptr<CBlockFileImport::CImportBlock> pimport = import.Next();
+            if (!pimport)
+                break;
+            if (!pimport->fValid)
+            {
+                LogPrintf("%s() : Deserialize error caught during load\n", __PRETTY_FUNCTION__);
+                continue;
+            }
+            try {
+                LOCK(cs_main);
+                if (ProcessBlock(NULL, &pimport->block, pimport->fPrechecked))
+                    nLoaded++;
+            }
+            catch (std::exception &e) {
+                LogPrintf("%s() : Exception caught processing block %s : %s\n",
+                    __PRETTY_FUNCTION__, pimport->block.GetHash().ToString(), e.what());
+            }
+        }
+    }
+    catch (boost::thread_interrupted&) {
+        fclose(fileIn);
+        throw;
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s() : Error caught during load : %s\n", __PRETTY_FUNCTION__, e.what());
+    }
+    fclose(fileIn);
+
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
@@ -3481,6 +4010,66 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 }
 
 
+// Complete "block" messages recently sent to peers, so blocks requested by
+// many peers at once (the tip, or the blocks of an initial download served
+// by a seed node) are read and checksummed once. Bounded by -blockservecache
+// bytes, least recently served first out.
+class CBlockServeCache
+{
+private:
+    typedef CSerializeDataPtr MessagePtr;
+    typedef std::list<std::pair<uint256, MessagePtr> > MessageList;
+
+    CCriticalSection cs;
+    MessageList listMessages; // most recently served first
+    std::map<uint256, MessageList::iterator> mapMessages;
+    size_t nBytes;
+
+public:
+    CBlockServeCache() : nBytes(0) {}
+
+    MessagePtr Get(CBlockIndex* pindex)
+    {
+        uint256 hash = pindex->GetBlockHash();
+        {
+            LOCK(cs);
+            std::map<uint256, MessageList::iterator>::iterator mi = mapMessages.find(hash);
+            if (mi != mapMessages.end())
+            {
+                listMessages.splice(listMessages.begin(), listMessages, mi->second);
+                return mi->second->second;
+            }
+        }
+
+        CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+        ssMsg << CMessageHeader("block", 0);
+        if (!ReadRawBlockFromDisk(ssMsg, pindex))
+            return MessagePtr();
+        FinishMessageHeader(ssMsg);
+        CSerializeData* pvMsg = new CSerializeData();
+        ssMsg.SwapAndClear(*pvMsg);
+        MessagePtr pMsg(pvMsg);
+
+        if (pMsg->size() > nBlockServeCacheSize)
+            return pMsg;
+
+        LOCK(cs);
+        if (mapMessages.count(hash))
+            return pMsg;
+        listMessages.push_front(std::make_pair(hash, pMsg));
+        mapMessages[hash] = listMessages.begin();
+        nBytes += pMsg->size();
+        while (nBytes > nBlockServeCacheSize)
+        {
+            nBytes -= listMessages.back().second->size();
+            mapMessages.erase(listMessages.back().first);
+            listMessages.pop_back();
+        }
+        return pMsg;
+    }
+};
+static CBlockServeCache blockServeCache;
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3503,11 +4092,22 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                if (mi == mapBlockIndex.end())
+                    vNotFound.push_back(inv);
+                else
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    if (nBlockServeCacheSize > 0)
+                    {
+                        CSerializeDataPtr pMsg = blockServeCache.Get((*mi).second);
+                        if (pMsg)
+                            pfrom->PushSerializedMessage("block", pMsg);
+                    }
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3527,15 +4127,15 @@ void static ProcessGetData(CNode* pfrom)
                 if(fDebug) LogPrintf("ProcessGetData -- Starting \n");
                 // Send stream from relay memory
                 bool pushed = false;
-                /*{
+                if (inv.type == MSG_TX) {
+                    // Share the message serialized when the transaction was relayed
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializeDataPtr>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        if(fDebug) LogPrintf("ProcessGetData -- pushed = true Rest will fail\n");
+                        pfrom->PushSerializedMessage("tx", (*mi).second);
                         pushed = true;
                     }
-                }*/
+                }
                 if (!pushed && inv.type == MSG_TX) {
 
                     CTransaction tx;
@@ -3614,16 +4214,55 @@ void static ProcessGetData(CNode* pfrom)
 
     if (!vNotFound.empty()) {
         // Let the peer know that we didn't find what it asked for, so it doesn't
-        // have to wait around forever. Currently only SPV clients actually care
-        // about this message: it's needed when they are recursively walking the
-        // dependencies of relevant unconfirmed transactions. SPV clients want to
-        // do that because they want to know about (and store and rebroadcast and
-        // risk analyze) the dependencies of transactions relevant to them, without
-        // having to download the entire memory pool.
+        // have to wait around forever. SPV clients need this when they are
+        // recursively walking the dependencies of relevant unconfirmed
+        // transactions, and headers-first peers use it for blocks to find out
+        // which headers nobody can back with a block.
         pfrom->PushMessage("notfound", vNotFound);
     }
 }
 
+// Commands whose handlers touch only the sending node, its own locked
+// buffers and the address manager. Once the peer's version has been
+// processed these never take cs_main and may be processed by any message
+// handler thread; everything else, and anything before the version, is
+// processed in order by ThreadMessageHandler. Outbound peers' getaddr
+// falls through to the handlers that need cs_main.
+static bool IsParallelMessage(const CNode* pfrom, const string& strCommand)
+{
+    if (!pfrom->fSuccessfullyConnected || pfrom->nVersion == 0)
+        return false;
+    return strCommand == "ping" || strCommand == "pong" || strCommand == "verack" ||
+           strCommand == "addr" || (strCommand == "getaddr" && pfrom->fInbound);
+}
+
+// Requires cs_main. Process a block a peer sent in full or as a compact block.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+
+    // Remember who we got this block from.
+    mapBlockSource[hashBlock] = pfrom->GetId();
+    MarkBlockAsReceived(hashBlock, pfrom->GetId());
+
+    ProcessBlock(pfrom, &block);
+    if (block.nDoS)
+    {
+        Misbehaving(pfrom->GetId(), block.nDoS);
+        RejectHeaderChainBlock(hashBlock, block.nDoS);
+    }
+}
+
+// Requires cs_main. Fall back to getdata for a compact block we couldn't rebuild,
+// unless the peer already has as many blocks in flight as it may.
+void static RequestFullBlock(CNode* pfrom, const uint256& hashBlock)
+{
+    if (State(pfrom->GetId())->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        return;
+    MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3634,6 +4273,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
+    // Peer-local commands may run on a parallel handler thread without cs_main
+    if (!IsParallelMessage(pfrom, strCommand))
     {
         LOCK(cs_main);
         State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
@@ -3748,6 +4389,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
+        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -3756,6 +4398,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Have the peers we connected to push new blocks to us as compact blocks
+        pfrom->PushMessage("sendcmpct", !pfrom->fInbound, CMPCTBLOCKS_VERSION);
     }
 
 
@@ -3769,6 +4414,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return true;
         if (vAddr.size() > 1000)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -3855,7 +4501,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     else
                         pfrom->AskFor(inv);
                 }
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash) && !mapHeaderChainHeight.count(inv.hash)) {
                 PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
             }
 
@@ -3929,8 +4575,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         LOCK(cs_main);
 
+        // An empty answer lets the peer sync with getblocks instead
         if (IsInitialBlockDownload())
+        {
+            pfrom->PushMessage("headers", vector<CBlock>());
             return true;
+        }
 
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
@@ -3950,7 +4600,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3962,6 +4612,95 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        state->nHeadersRequestTime = 0;
+
+        // Headers only link up and pass the checkpoints here; proof-of-stake
+        // can't be checked without the coinstake, so blocks along the
+        // header chain are fully validated as they connect.
+        bool fAdvanced = false;
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+        {
+            const CBlock& header = vHeaders[i];
+            uint256 hash = header.GetHash();
+
+            int nHeight;
+            map<uint256, int>::iterator mi = mapHeaderChainHeight.find(header.hashPrevBlock);
+            map<uint256, CBlockIndex*>::iterator miIndex = mapBlockIndex.find(header.hashPrevBlock);
+            if (mi != mapHeaderChainHeight.end())
+                nHeight = mi->second + 1;
+            else if (miIndex != mapBlockIndex.end())
+                nHeight = miIndex->second->nHeight + 1;
+            else
+            {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("ProcessMessage() : headers don't connect at %s", hash.ToString());
+            }
+            state->nHeadersHeight = max(state->nHeadersHeight, nHeight);
+            state->nNotFoundHeight = max(state->nNotFoundHeight, nHeight + 1);
+
+            if (mapBlockIndex.count(hash) || mapHeaderChainHeight.count(hash))
+                continue;
+
+            if (!Checkpoints::CheckHardened(nHeight, hash))
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("ProcessMessage() : header %s rejected by checkpoint at height %d", hash.ToString(), nHeight);
+            }
+            if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+                return error("ProcessMessage() : header %s timestamp too far in the future", hash.ToString());
+            // Before proof-of-stake starts every block is proof-of-work, so its header carries its proof
+            if (nHeight < Params().StartPoSBlock() && !CheckProofOfWork(header.GetPoWHash(), header.nBits))
+            {
+                Misbehaving(pfrom->GetId(), 50);
+                return error("ProcessMessage() : header %s has invalid proof-of-work", hash.ToString());
+            }
+
+            // Switch to a competing branch only if it reaches further
+            if (nHeight <= HeaderChainTip())
+            {
+                if (nHeight + (int)(vHeaders.size() - i) - 1 <= HeaderChainTip())
+                    break;
+                TruncateHeaderChain(nHeight);
+            }
+            if (!vHeaderChain.empty() && vHeaderChain.back() != header.hashPrevBlock)
+                TruncateHeaderChain(nHeaderChainStart);
+            if (vHeaderChain.empty())
+                nHeaderChainStart = nHeight;
+
+            vHeaderChain.push_back(hash);
+            vHeaderChainSource.push_back(pfrom->GetId());
+            mapHeaderChainHeight[hash] = nHeight;
+            fAdvanced = true;
+        }
+
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && fAdvanced)
+        {
+            // There are more; wait for the blocks if we are far enough ahead
+            if (HeaderChainTip() - nBestHeight < MAX_HEADERS_AHEAD)
+                PushGetHeaders(pfrom);
+            else
+                state->fHeadersPending = true;
+        }
+        else if (vHeaderChain.empty() && pfrom->nStartingHeight > nBestHeight)
+        {
+            // Nothing to download along headers, perhaps the peer is syncing itself
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+        }
+    }
+
+
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
         vector<uint256> vWorkQueue;
@@ -4103,12 +4842,150 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->AddInventoryKnown(inv);
 
         LOCK(cs_main);
-        // Remember who we got this block from.
-        mapBlockSource[inv.hash] = pfrom->GetId();
-        MarkBlockAsReceived(inv.hash, pfrom->GetId());
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        uint64_t nCmpctVersion = 0;
+        vRecv >> fAnnounce >> nCmpctVersion;
+        if (nCmpctVersion == CMPCTBLOCKS_VERSION)
+            pfrom->fSendCompactBlocks = fAnnounce;
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s (%u txs, %u prefilled)\n", hashBlock.ToString(), cmpctblock.BlockTxCount(), cmpctblock.prefilledtxn.size());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock) || mapBlocksInFlight.count(hashBlock))
+            return true;
+
+        // Only a block on our tip is rebuilt from the memory pool. Others,
+        // including those whose parent we lack, are fetched in full and
+        // left to the orphan logic.
+        CNodeState *state = State(pfrom->GetId());
+        if (cmpctblock.header.hashPrevBlock != hashBestChain)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        // Forget rebuilds another peer completed, then keep to the per-peer limit
+        for (map<uint256, CPartialBlock>::iterator it = state->mapPartialBlocks.begin(); it != state->mapPartialBlocks.end(); )
+        {
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(it->first);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId())
+                state->mapPartialBlocks.erase(it++);
+            else
+                it++;
+        }
+        if (state->mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS_PER_PEER ||
+            state->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        CPartialBlock& partial = state->mapPartialBlocks[hashBlock];
+        CPartialBlock::ReadStatus status = partial.InitData(cmpctblock, mempool);
+        if (status == CPartialBlock::READ_INVALID)
+        {
+            state->mapPartialBlocks.erase(hashBlock);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("ProcessMessage() : invalid compact block %s", hashBlock.ToString());
+        }
+        if (status == CPartialBlock::READ_FAILED)
+        {
+            state->mapPartialBlocks.erase(hashBlock);
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partial.GetMissing(req.indexes);
+        if (req.indexes.empty())
+        {
+            CBlock block;
+            status = partial.FillBlock(block, vector<CTransaction>());
+            state->mapPartialBlocks.erase(hashBlock);
+            if (status == CPartialBlock::READ_OK)
+                ProcessReceivedBlock(pfrom, block);
+            else
+                RequestFullBlock(pfrom, hashBlock);
+        }
+        else
+        {
+            LogPrint("net", "requesting %u transactions of compact block %s\n", req.indexes.size(), hashBlock.ToString());
+            MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("ProcessMessage() : getblocktxn can't read block %s", req.blockhash.ToString());
+
+        CBlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.indexes.size(); i++)
+        {
+            if (req.indexes[i] >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("ProcessMessage() : getblocktxn index %u out of range", req.indexes[i]);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
 
-        ProcessBlock(pfrom, &block);
-        if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        map<uint256, CPartialBlock>::iterator mi = state->mapPartialBlocks.find(resp.blockhash);
+        if (mi == state->mapPartialBlocks.end())
+            return true;
+
+        CBlock block;
+        CPartialBlock::ReadStatus status = mi->second.FillBlock(block, resp.txn);
+        state->mapPartialBlocks.erase(mi);
+        if (status == CPartialBlock::READ_INVALID)
+        {
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("ProcessMessage() : invalid blocktxn for %s", resp.blockhash.ToString());
+        }
+        if (status == CPartialBlock::READ_FAILED)
+            RequestFullBlock(pfrom, resp.blockhash);
+        else
+            ProcessReceivedBlock(pfrom, block);
     }
 
     // This asymmetric behavior for inbound and outbound connections was introduced
@@ -4120,7 +4997,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -4177,6 +5057,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         bool bPingFinished = false;
         std::string sProblem;
 
+        // SendMessages starts pings under the same lock
+        LOCK(pfrom->cs_vSend);
         if (nAvail >= sizeof(nonce)) {
             vRecv >> nonce;
 
@@ -4257,6 +5139,31 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message notfound size() = %u", vInv.size());
+        }
+
+        LOCK(cs_main);
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            if (inv.type != MSG_BLOCK)
+                continue;
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId())
+                continue;
+            MarkBlockAsReceived(inv.hash);
+            HeaderChainBlockNotFound(pfrom->GetId(), inv.hash);
+        }
+    }
+
+
     else
     {
         mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
@@ -4314,7 +5221,10 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char
 }
 
 // requires LOCK(cs_vRecvMsg)
-bool ProcessMessages(CNode* pfrom)
+// fParallelOnly: only process the next message if IsParallelMessage, and
+// leave queued getdata requests to ThreadMessageHandler; requires
+// LOCK(cs_vRecvMsg), and LOCK(cs_vSend) unless fParallelOnly
+bool ProcessMessages(CNode* pfrom, bool fParallelOnly)
 {
     //if (fDebug)
     //    LogPrintf("ProcessMessages(%zu messages)\n", pfrom->vRecvMsg.size());
@@ -4329,6 +5239,9 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    if (fParallelOnly && !pfrom->vRecvGetData.empty())
+        return fOk;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
@@ -4353,6 +5266,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // the message stays queued until ThreadMessageHandler gets to it
+        if (fParallelOnly && !IsParallelMessage(pfrom, msg.hdr.GetCommand()))
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -4375,11 +5292,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, hashed by the socket thread as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash_bmw512(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        memcpy(&nChecksum, &msg.hashData, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
@@ -4411,7 +5327,7 @@ bool ProcessMessages(CNode* pfrom)
                 PrintExceptionContinue(&e, "ProcessMessages()");
             }
         }
-        catch (boost::thread_interrupted) {
+        catch (boost::thread_interrupted&) {
             throw;
         }
         catch (std::exception& e) {
@@ -4478,7 +5394,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            PushGetHeaders(pto);
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4499,7 +5415,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4518,28 +5437,30 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            // addr handlers on other threads may push to this node concurrently
+            vector<CAddress> vAddrToSend;
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddrToSend.swap(pto->vAddrToSend);
+                vAddr.reserve(vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
         }
 
         CNodeState &state = *State(pto->GetId());
+        if (state.fShouldDisconnect) {
+            pto->fDisconnect = true;
+            state.fShouldDisconnect = false;
+        }
         if (state.fShouldBan) {
             if (pto->addr.IsLocal())
                 LogPrintf("Warning: not banning local node %s!\n", pto->addr.ToString().c_str());
@@ -4558,46 +5479,38 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+
+            // Transactions are announced in batches at Poisson distributed
+            // times, independently for each peer, to protect privacy
+            int64_t nNowInv = GetTimeMicros();
+            bool fSendTxInv = (pto->nNextInvSend < nNowInv);
+            if (fSendTxInv)
+                pto->nNextInvSend = PoissonNextSend(nNowInv, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+
+            vInv.reserve(min(pto->vInventoryToSend.size(), (size_t)1000));
+            vector<CInv>::iterator itWait = pto->vInventoryToSend.begin();
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (inv.type == MSG_TX && !fSendTxInv)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash_bmw512(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    *itWait++ = inv;
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (pto->filterInventoryKnown.contains(inv.hash, inv.type))
+                    continue;
+                pto->filterInventoryKnown.insert(inv.hash, inv.type);
+
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.erase(itWait, pto->vInventoryToSend.end());
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -4610,10 +5523,36 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!pto->fDisconnect && state.nBlocksInFlight && 
             state.nLastBlockReceive < state.nLastBlockProcess - BLOCK_DOWNLOAD_TIMEOUT*1000000 && 
             state.vBlocksInFlight.front().nTime < state.nLastBlockProcess - 2*BLOCK_DOWNLOAD_TIMEOUT*1000000) {
-            LogPrintf("Peer %s is stalling block download, disconnecting\n", state.name.c_str());
-            pto->fDisconnect = true;
+            // A header chain block supplied by another peer may not exist at
+            // all: the supplier, not this peer, is asked to back its header
+            uint256 hashStalled = state.vBlocksInFlight.front().hash;
+            map<uint256, int>::iterator mi = mapHeaderChainHeight.find(hashStalled);
+            NodeId nodeSource = mi == mapHeaderChainHeight.end() ? pto->GetId() : vHeaderChainSource[mi->second - nHeaderChainStart];
+            if (nodeSource != pto->GetId()) {
+                LogPrintf("Peer %s is stalling header chain block %s, asking its supplier peer=%d\n", state.name.c_str(), hashStalled.ToString(), nodeSource);
+                MarkBlockAsReceived(hashStalled);
+                if (!HeaderChainBlockNotFound(pto->GetId(), hashStalled))
+                    AddBlockToQueue(nodeSource, hashStalled);
+            } else {
+                LogPrintf("Peer %s is stalling block download, disconnecting\n", state.name.c_str());
+                if (mi != mapHeaderChainHeight.end())
+                    HeaderChainBlockNotFound(pto->GetId(), hashStalled);
+                pto->fDisconnect = true;
+            }
+        }
+
+
+        // Headers-first sync: fall back to getblocks with peers that don't
+        // answer getheaders, and continue headers once blocks have caught up
+        if (state.nHeadersRequestTime && GetTime() - state.nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT) {
+            state.nHeadersRequestTime = 0;
+            PushGetBlocks(pto, pindexBest, uint256(0));
         }
+        if (state.fHeadersPending && HeaderChainTip() - nBestHeight < MAX_HEADERS_AHEAD / 2)
+            PushGetHeaders(pto);
 
+        if (!pto->fDisconnect && !fImporting && !fReindex)
+            QueueHeaderChainBlocks(pto->GetId(), state, max(pto->nStartingHeight, state.nHeadersHeight));
 
         //
         // Message: getdata (blocks)
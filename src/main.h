@@ -8,7 +8,6 @@
 #include "chain.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
@@ -26,6 +25,8 @@ class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CScriptCheck;
+class CTxMemPool;
 class CWallet;
 
 /** The maximum allowed multiple for the computed block size */
@@ -52,6 +53,14 @@ static unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 10000;
+/** Default for -maxmempool, maximum megabytes of memory used by the transaction memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -blockservecache, megabytes of serialized blocks kept for answering getdata */
+static const unsigned int DEFAULT_BLOCK_SERVE_CACHE = 32;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 0.0001*COIN;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -68,8 +77,18 @@ inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_SI
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Number of compact blocks from a single peer that can wait for their missing transactions. */
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 3;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Number of headers sent in one "headers" message; a full message means more follow. */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Blocks of the header chain, from the first one we lack, that are downloaded in parallel. */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Headers are not requested further than this many blocks ahead of our best block. */
+static const int MAX_HEADERS_AHEAD = 100000;
+/** Timeout in seconds before syncing with getblocks from a peer that did not answer getheaders. */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT = 60;
 /** Defaults to yes, adaptively increase/decrease max/min/priority along with the re-calculated block size **/
 static const unsigned int DEFAULT_SCALE_BLOCK_SIZE_OPTIONS = 1;
 /** Future drift value */
@@ -105,6 +124,9 @@ extern bool fHaveGUI;
 // Settings
 extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
+extern int nScriptCheckThreads;
+extern unsigned int nBlockServeCacheSize;
+extern size_t nMaxMempoolSize;
 
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
@@ -115,6 +137,7 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CCoins;
 class CWalletInterface;
 struct CNodeStateStats;
 
@@ -134,24 +157,29 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+/** Process a block. fPrechecked: its proof of work, merkle root and signature were checked already */
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked = false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CBlockIndex* pindex);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
-bool ProcessMessages(CNode* pfrom);
+bool ProcessMessages(CNode* pfrom, bool fParallelOnly);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 bool IsInitialBlockDownload();
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
+bool GetCoinsForOutput(CTxDB& txdb, const COutPoint& prevout, CTxIndex& txindexRet, CCoins& coinsRet);
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 
 /** (try to) add transaction to memory pool **/
@@ -236,14 +264,69 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, std::pair<CTxIndex, CCoins> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree, enum GetMinFee_mode mode);
 
 
 
+/** Memory-only hash and size of a transaction. A copy starts out empty, so
+ * a transaction copied and then modified never reports the original's hash.
+ * Transactions in blocks and the memory pool are read by several threads at
+ * once, so the cache is filled and read under its own lock.
+ */
+class CTransactionCache
+{
+private:
+    mutable boost::mutex mutex;
+    uint256 hash;
+    unsigned int nSize;
+
+public:
+    CTransactionCache() : hash(0), nSize(0) {}
+    CTransactionCache(const CTransactionCache&) : hash(0), nSize(0) {}
+    CTransactionCache& operator=(const CTransactionCache&) { Clear(); return *this; }
+
+    void Clear()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        hash = 0;
+        nSize = 0;
+    }
+
+    // 0 if not known yet
+    uint256 GetHash() const
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return hash;
+    }
+
+    void SetHash(const uint256& hashIn)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        hash = hashIn;
+    }
+
+    // 0 if not known yet
+    unsigned int GetSize() const
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return nSize;
+    }
+
+    void SetSize(unsigned int nSizeIn)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        nSize = nSizeIn;
+    }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
+ *
+ * The hash and serialized size are computed on first use and kept until
+ * InvalidateCache() is called. Code that changes a transaction after it may
+ * have been hashed must call InvalidateCache() once the change is made.
  */
 class CTransaction
 {
@@ -259,6 +342,9 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only
+    mutable CTransactionCache cache;
+
     CTransaction()
     {
         SetNull();
@@ -271,12 +357,24 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
-        READWRITE(this->nVersion);
-        nVersion = this->nVersion;
-        READWRITE(nTime);
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
+        // The encoding does not depend on nType or nVersion, so one cached
+        // size answers every GetSerializeSize call
+        unsigned int nCachedSize = fGetSize ? cache.GetSize() : 0;
+        if (nCachedSize != 0)
+            nSerSize = nCachedSize;
+        else
+        {
+            READWRITE(this->nVersion);
+            nVersion = this->nVersion;
+            READWRITE(nTime);
+            READWRITE(vin);
+            READWRITE(vout);
+            READWRITE(nLockTime);
+        }
+        if (fGetSize && nCachedSize == 0)
+            cache.SetSize(nSerSize);
+        if (fRead)
+            InvalidateCache();
     )
 
     void SetNull()
@@ -287,6 +385,12 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        InvalidateCache();
+    }
+
+    void InvalidateCache() const
+    {
+        cache.Clear();
     }
 
     bool IsNull() const
@@ -296,7 +400,13 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        uint256 hash = cache.GetHash();
+        if (hash == 0)
+        {
+            hash = SerializeHash(*this);
+            cache.SetHash(hash);
+        }
+        return hash;
     }
 
     bool IsCoinBase() const
@@ -426,11 +536,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock   true if called from ConnectBlock
         @param[in] fMiner   true if called from CreateNewBlock
+        @param[out] pvChecks    If non-null, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -606,6 +718,150 @@ public:
 };
 
 
+/** Height given to coins of transactions that are only in the memory pool */
+static const int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+
+/** The outputs of one transaction that are still unspent, with what
+ * validation needs to know about the transaction itself. Spent outputs are
+ * nulled rather than removed so the rest keep their index.
+ *
+ * Stored in the transaction database next to the CTxIndex of the same hash,
+ * which stays the authority on which outputs are spent. Inputs are resolved
+ * from these records instead of reading the previous transaction from the
+ * block files.
+ *
+ * Serialized form:
+ * - VARINT(nHeight * 4 + fCoinStake * 2 + fCoinBase)
+ * - nTime, nBlockTime
+ * - VARINT(number of outputs), then a bitmask of the unspent ones
+ * - each unspent output, compressed
+ */
+class CCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nBlockTime;
+    std::vector<CTxOut> vout;
+
+    CCoins() : fCoinBase(false), fCoinStake(false), nHeight(0), nTime(0), nBlockTime(0) { }
+
+    CCoins(const CTransaction& tx, int nHeightIn, unsigned int nBlockTimeIn) :
+        fCoinBase(tx.IsCoinBase()), fCoinStake(tx.IsCoinStake()), nHeight(nHeightIn),
+        nTime(tx.nTime), nBlockTime(nBlockTimeIn), vout(tx.vout) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CCoins* pthis = const_cast<CCoins*>(this);
+        unsigned int nCode = nHeight * 4 + (fCoinStake ? 2 : 0) + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        READWRITE(nTime);
+        READWRITE(nBlockTime);
+        unsigned int nOutputs = vout.size();
+        READWRITE(VARINT(nOutputs));
+        std::vector<unsigned char> vAvail((nOutputs + 7) / 8, 0);
+        for (unsigned int i = 0; i < vout.size(); i++)
+            if (!vout[i].IsNull())
+                vAvail[i / 8] |= 1 << (i % 8);
+        READWRITE(vAvail);
+        if (fRead)
+        {
+            if (vAvail.size() != (nOutputs + 7) / 8)
+                throw std::ios_base::failure("CCoins : output bitmask size mismatch");
+            pthis->fCoinBase = nCode & 1;
+            pthis->fCoinStake = nCode & 2;
+            pthis->nHeight = nCode / 4;
+            pthis->vout.assign(nOutputs, CTxOut());
+        }
+        for (unsigned int i = 0; i < nOutputs; i++)
+        {
+            if (vAvail[i / 8] & (1 << (i % 8)))
+            {
+                CTxOutCompressor txout(pthis->vout[i]);
+                READWRITE(txout);
+            }
+        }
+    )
+
+    bool IsCoinBase() const
+    {
+        return fCoinBase;
+    }
+
+    bool IsCoinStake() const
+    {
+        return fCoinStake;
+    }
+
+    bool IsAvailable(unsigned int n) const
+    {
+        return n < vout.size() && !vout[n].IsNull();
+    }
+
+    void Spend(unsigned int n)
+    {
+        if (n < vout.size())
+            vout[n].SetNull();
+    }
+
+    // Null the outputs txindex marks as spent
+    void Spend(const CTxIndex& txindex)
+    {
+        for (unsigned int n = 0; n < txindex.vSpent.size(); n++)
+            if (!txindex.vSpent[n].IsNull())
+                Spend(n);
+    }
+
+    // True once nothing is left that can be spent; coinstake markers and
+    // other empty outputs never are
+    bool IsPruned() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (!txout.IsNull() && !txout.IsEmpty())
+                return false;
+        return true;
+    }
+
+    // Rebuild from the transaction and block header txindex points to
+    bool ReadFromDisk(const CTxIndex& txindex);
+
+    std::string ToString() const
+    {
+        return strprintf("CCoins(height=%d, time=%u, blocktime=%u, coinbase=%d, coinstake=%d, vout.size=%u)",
+            nHeight, nTime, nBlockTime, fCoinBase, fCoinStake, vout.size());
+    }
+};
+
+
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0) {}
+    CScriptCheck(const CCoins& coinsIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn) :
+        scriptPubKey(coinsIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+    }
+};
+
+
 
 
 
@@ -972,6 +1228,8 @@ public:
     unsigned int nNonce;
     // (memory only) Sequencial id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
+    // (memory only) Serialized size of the block, 0 until known.
+    unsigned int nBlockSize;
 
     CBlockIndex()
     {
@@ -991,6 +1249,7 @@ public:
         prevoutStake.SetNull();
         nStakeTime = 0;
         nSequenceId = 0;
+        nBlockSize = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1015,6 +1274,7 @@ public:
         bnStakeModifierV2 = 0;
         hashProof = 0;
         nSequenceId = 0;
+        nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
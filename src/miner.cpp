@@ -6,6 +6,7 @@
 
 #include "blockparams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "miner.h"
 #include "kernel.h"
 #include "floatingcityman.h"
@@ -56,29 +57,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -184,79 +168,21 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 //> ZLM <
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
+        // Size, fees, priority and in-pool parents were cached when the
+        // transactions entered the pool, so no inputs are read here.
+        // High priority transactions go first, up to -blockprioritysize.
+        // The rest are taken by walking the pool's fee rate index, merging
+        // back in those passed while their parents were not in the block yet.
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                const CTxMemPoolEntry& entry = mi->second;
+                double dPriority = entry.GetPriority(nHeight);
+                if (entry.setParents.empty() && dPriority >= COIN * 144 / 250)
+                    vecPriority.push_back(TxPriority(dPriority, entry.GetFeeRate(), &entry));
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
         // Collect transactions into block
@@ -264,23 +190,69 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
         int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        bool fSortedByFee = vecPriority.empty();
 
-        TxPriorityCompare comparer(fSortedByFee);
+        TxPriorityCompare comparer(false);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-        while (!vecPriority.empty())
+        set<uint256> setInBlock;
+        set<uint256> setWaiting;                  // passed by the walk, waiting for parents
+        vector<pair<double, uint256> > vecReady;  // heap of those whose parents are in now
+        set<pair<double, uint256> >::reverse_iterator itFeeRate = mempool.setTxByFeeRate.rbegin();
+
+        while (true)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            // Take the highest priority transaction, or the highest fee rate
+            // one of the index and those ready again
+            const CTxMemPoolEntry* pentry;
+            if (!fSortedByFee)
+            {
+                if (vecPriority.empty())
+                {
+                    fSortedByFee = true;
+                    continue;
+                }
+                pentry = vecPriority.front().get<2>();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+            }
+            else if (!vecReady.empty() && (itFeeRate == mempool.setTxByFeeRate.rend() || vecReady.front() > *itFeeRate))
+            {
+                pentry = &mempool.mapTx[vecReady.front().second];
+                std::pop_heap(vecReady.begin(), vecReady.end());
+                vecReady.pop_back();
+            }
+            else if (itFeeRate != mempool.setTxByFeeRate.rend())
+                pentry = &mempool.mapTx[(itFeeRate++)->second];
+            else
+                break;
+
+            const CTxMemPoolEntry& entry = *pentry;
+            const CTransaction& tx = entry.GetTx();
+            uint256 hash = tx.GetHash();
+            if (setInBlock.count(hash) || tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                continue;
+
+            // Has to wait for dependencies
+            bool fParentsInBlock = true;
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                if (!setInBlock.count(hashParent))
+                {
+                    fParentsInBlock = false;
+                    break;
+                }
+            if (!fParentsInBlock)
+            {
+                if (fSortedByFee)
+                    setWaiting.insert(hash);
+                continue;
+            }
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            double dPriority = entry.GetPriority(nHeight);
+            double dFeePerKb = entry.GetFeeRate();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = entry.GetTxSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
@@ -298,13 +270,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                 continue;
 
             // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
+            // transactions; the fee rate walk comes back to this one
             if (!fSortedByFee &&
                 ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
             {
                 fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                continue;
             }
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
@@ -326,11 +297,12 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             // create only contains transactions that are valid in new blocks.
             if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+            mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
             swap(mapTestPool, mapTestPoolTmp);
 
             // Added
             pblock->vtx.push_back(tx);
+            setInBlock.insert(hash);
             nBlockSize += nTxSize;
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
@@ -339,24 +311,33 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             if (fDebug && GetBoolArg("-printpriority", false))
             {
                 LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                       dPriority, dFeePerKb, hash.ToString());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            // Transactions that depend on this one may be ready now
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
+                const CTxMemPoolEntry& child = mempool.mapTx[hashChild];
+                bool fReady = true;
+                BOOST_FOREACH(const uint256& hashParent, child.setParents)
+                    if (!setInBlock.count(hashParent))
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        fReady = false;
+                        break;
                     }
+                if (!fReady)
+                    continue;
+
+                double dChildPriority = child.GetPriority(nHeight);
+                if (!fSortedByFee && dChildPriority >= COIN * 144 / 250)
+                {
+                    vecPriority.push_back(TxPriority(dChildPriority, child.GetFeeRate(), &child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                }
+                else if (setWaiting.erase(hashChild))
+                {
+                    vecReady.push_back(make_pair(child.GetFeeRate(), hashChild));
+                    std::push_heap(vecReady.begin(), vecReady.end());
                 }
             }
         }
@@ -368,7 +349,10 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 // > ZLM <
         if (!fProofOfStake)
+        {
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight + 1, nFees);
+            pblock->vtx[0].InvalidateCache();
+        }
 
         if (pFees)
             *pFees = nFees;
@@ -399,6 +383,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateCache();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -5,6 +5,7 @@
 #include "db.h"
 #include "net.h"
 #include "main.h"
+#include "txmempool.h"
 #include "addrman.h"
 #include "chainparams.h"
 #include "chain.h"
@@ -16,6 +17,12 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -38,6 +45,14 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 12;
 
+// Most send buffers kept for reuse, and the largest capacity kept
+static const unsigned int MAX_SEND_BUFFER_POOL = 256;
+static const size_t MAX_POOLED_SEND_BUFFER = 256 * 1024;
+#ifndef WIN32
+// Most queued messages handed to the kernel by one sendmsg call
+static const int MAX_SEND_IOVECS = 64;
+#endif
+
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
 
@@ -57,10 +72,33 @@ static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 std::string strSubVersion;
 int nMaxConnections = GetArg("-maxconnections", 125);
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+int nMessageHandlerThreads = DEFAULT_MSGHANDLER_THREADS;
+// Signalled by the socket thread when complete messages have arrived
+static boost::condition_variable condMsgProc;
+static boost::mutex mutexMsgProc;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+// eventfd that interrupts epoll_wait when a node needs write interest
+static int hEpollWakeup = -1;
+#endif
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+static vector<CSerializeData*> vSendBufferPool;
+static CCriticalSection cs_vSendBufferPool;
+
+// Receive buffers are recycled by size class, each class keeping a few
+// buffers with at least its size in capacity. Larger messages get their own.
+static const struct { size_t nSize; unsigned int nMaxPooled; } recvBufferClasses[] = {
+    {        4 * 1024, 256 },
+    {       64 * 1024,  64 },
+    {     1024 * 1024,   8 },
+};
+static const int RECV_BUFFER_CLASSES = sizeof(recvBufferClasses) / sizeof(recvBufferClasses[0]);
+static vector<CSerializeData> vRecvBufferPool[RECV_BUFFER_CLASSES];
+static CCriticalSection cs_vRecvBufferPool;
+map<CInv, CSerializeDataPtr> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -89,6 +127,11 @@ void AddOneShot(string strDest)
     vOneShots.push_back(strDest);
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 unsigned short GetListenPort()
 {
     return (unsigned short)(GetArg("-port", Params().GetDefaultPort()));
@@ -682,21 +725,68 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// Give vRecv a buffer from the pool big enough for nSize bytes
+static void AcquireRecvBuffer(CDataStream& vRecv, size_t nSize)
+{
+    for (int i = 0; i < RECV_BUFFER_CLASSES; i++)
+    {
+        if (nSize > recvBufferClasses[i].nSize)
+            continue;
+        {
+            LOCK(cs_vRecvBufferPool);
+            if (!vRecvBufferPool[i].empty())
+            {
+                vRecv.SwapAndClear(vRecvBufferPool[i].back());
+                vRecvBufferPool[i].pop_back();
+                return;
+            }
+        }
+        vRecv.reserve(recvBufferClasses[i].nSize);
+        return;
+    }
+}
+
+static void ReleaseRecvBuffer(CDataStream& vRecv)
+{
+    CSerializeData data;
+    vRecv.SwapAndClear(data);
+    size_t nCapacity = data.capacity();
+    if (nCapacity < recvBufferClasses[0].nSize || nCapacity >= 2 * recvBufferClasses[RECV_BUFFER_CLASSES - 1].nSize)
+        return;
+
+    int i = RECV_BUFFER_CLASSES - 1;
+    while (nCapacity < recvBufferClasses[i].nSize)
+        i--;
+    data.clear();
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool[i].size() < recvBufferClasses[i].nMaxPooled)
+    {
+        vRecvBufferPool[i].push_back(CSerializeData());
+        vRecvBufferPool[i].back().swap(data);
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdrBuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
+        CDataStream hdrbuf(pchHdrBuf, pchHdrBuf + CMessageHeader::HEADER_SIZE, vRecv.GetType(), vRecv.GetVersion());
         hdrbuf >> hdr;
     }
     catch (std::exception &e) {
@@ -710,6 +800,11 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    if (hdr.nMessageSize == 0)
+        hashData = hasher.Finalize();
+    else
+        AcquireRecvBuffer(vRecv, hdr.nMessageSize);
+
     return nCopy;
 }
 
@@ -718,14 +813,21 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
-    }
+    // Messages bigger than every pooled buffer grow geometrically, at least
+    // 256 KiB ahead, but never beyond the total message size. Growing by a
+    // fixed step would copy the whole buffer again on every read.
+    if (nDataPos + nCopy > vRecv.capacity())
+        vRecv.reserve(std::min((size_t)hdr.nMessageSize, std::max(2 * vRecv.capacity(), (size_t)nDataPos + nCopy + 256 * 1024)));
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
+    // Checksum the data while it is still in cache, so big blocks aren't
+    // read a second time once they're complete
+    hasher.Write(pch, nCopy);
+    if (nDataPos == hdr.nMessageSize)
+        hashData = hasher.Finalize();
+
     return nCopy;
 }
 
@@ -920,25 +1022,86 @@ void IdleNodeCheck(CNode *pnode)
     return;
 }
 
+// Send buffers go back to the pool still holding their capacity, so the
+// next message is serialized without allocating or zero-filling memory
+static void ReleaseSendBuffer(CSerializeData* pdata)
+{
+    if (pdata->capacity() <= MAX_POOLED_SEND_BUFFER)
+    {
+        pdata->clear();
+        LOCK(cs_vSendBufferPool);
+        if (vSendBufferPool.size() < MAX_SEND_BUFFER_POOL)
+        {
+            vSendBufferPool.push_back(pdata);
+            return;
+        }
+    }
+    delete pdata;
+}
+
+boost::shared_ptr<CSerializeData> AllocSendBuffer()
+{
+    CSerializeData* pdata = NULL;
+    {
+        LOCK(cs_vSendBufferPool);
+        if (!vSendBufferPool.empty())
+        {
+            pdata = vSendBufferPool.back();
+            vSendBufferPool.pop_back();
+        }
+    }
+    if (!pdata)
+        pdata = new CSerializeData();
+    return boost::shared_ptr<CSerializeData>(pdata, ReleaseSendBuffer);
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializeDataPtr>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the kernel as many queued messages as fit in one call
+        struct iovec iov[MAX_SEND_IOVECS];
+        size_t nWant = 0;
+        int nIov = 0;
+        for (std::deque<CSerializeDataPtr>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov, ++nIov)
+        {
+            size_t nOffset = (nIov == 0) ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nWant += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Step past every message sent in full
+            size_t nLeft = nBytes;
+            while (nLeft > 0 && nLeft >= (*it)->size() - pnode->nSendOffset) {
+                nLeft -= (*it)->size() - pnode->nSendOffset;
+                pnode->nSendSize -= (*it)->size();
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
                 it++;
-            } else {
+            }
+            pnode->nSendOffset += nLeft;
+#ifdef WIN32
+            if (pnode->nSendOffset != 0) {
+#else
+            if (pnode->nSendOffset != 0 || (size_t)nBytes < nWant) {
+#endif
                 // could not send full message; stop sending more
                 LogPrintf("socket send error: interruption\n");
                 IdleNodeCheck(pnode);
@@ -968,13 +1131,306 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef USE_EPOLL
+    // Have the socket thread register write interest for the rest now
+    // rather than on its next pass
+    if (hEpollWakeup != -1 && !pnode->vSendMsg.empty() && !(pnode->nSocketEvents & EPOLLOUT))
+    {
+        uint64_t nOne = 1;
+        if (write(hEpollWakeup, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+            LogPrintf("socket events wakeup failed %d\n", errno);
+    }
+#endif
 }
 
 static list<CNode*> vNodesDisconnected;
 
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped (non-selectable socket)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        // According to the internet TCP_NODELAY is not carried into accepted sockets
+        // on all platforms.  Set it again here just to be sure.
+        int set = 1;
+#ifdef WIN32
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
+#else
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
+#endif
+
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Whether pnode has queued data waiting for its socket to drain
+static bool NodeWantsSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    return lockSend && !pnode->vSendMsg.empty();
+}
+
+// Whether pnode's receive buffer has room for more data
+static bool NodeWantsRecv(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    return lockRecv && (
+        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+        pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+}
+
+// Wait for readiness with select(), which reports it afresh on every pass
+static void SocketEventsSelect(vector<SOCKET>& vAcceptReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        if (!IsSelectableSocket(hListenSocket))
+            continue;
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!IsSelectableSocket(pnode->hSocket))
+            {
+                LogPrintf("socket %u of %s is beyond the reach of select()\n", pnode->hSocket, pnode->addr.ToString());
+                pnode->fDisconnect = true;
+                continue;
+            }
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            if (NodeWantsSend(pnode))
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (NodeWantsRecv(pnode))
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && IsSelectableSocket(hListenSocket) && FD_ISSET(hListenSocket, &fdsetRecv))
+            vAcceptReady.push_back(hListenSocket);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+                continue;
+            pnode->fSocketReadable = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+            pnode->fSocketWritable = FD_ISSET(pnode->hSocket, &fdsetSend);
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// Register the listening sockets and the wakeup eventfd with a new epoll
+// instance. Listening sockets stay level-triggered as only one connection
+// is accepted per pass.
+static bool InitSocketEventsEpoll()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return error("InitSocketEventsEpoll() : epoll_create1 failed %d", errno);
+    hEpollWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEpollWakeup == -1)
+        return error("InitSocketEventsEpoll() : eventfd failed %d", errno);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &hEpollWakeup;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hEpollWakeup, &event) == SOCKET_ERROR)
+        return error("InitSocketEventsEpoll() : registering eventfd failed %d", errno);
+    for (unsigned int i = 0; i < vhListenSocket.size(); i++)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &vhListenSocket[i];
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i], &event) == SOCKET_ERROR)
+            return error("InitSocketEventsEpoll() : registering listening socket failed %d", errno);
+    }
+    return true;
+}
+
+static void ShutdownSocketEventsEpoll()
+{
+    if (hEpoll != -1)
+        close(hEpoll);
+    if (hEpollWakeup != -1)
+        close(hEpollWakeup);
+    hEpoll = hEpollWakeup = -1;
+}
+
+// Wait for readiness with edge-triggered epoll. Each event is reported
+// once, so a node's readiness stays set until its socket has been drained;
+// fMoreWork skips the wait when some node still has data to read.
+static void SocketEventsEpoll(vector<SOCKET>& vAcceptReady, bool fMoreWork)
+{
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            // Only ask for writability while there is something to write
+            bool fWantSend = (pnode->nSocketEvents & EPOLLOUT) != 0;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    fWantSend = !pnode->vSendMsg.empty();
+            }
+            uint32_t nEvents = (uint32_t)EPOLLIN | (uint32_t)EPOLLRDHUP | (uint32_t)EPOLLET | (fWantSend ? (uint32_t)EPOLLOUT : (uint32_t)0);
+            if (nEvents == pnode->nSocketEvents)
+                continue;
+
+            struct epoll_event event;
+            event.events = nEvents;
+            event.data.ptr = pnode;
+            if (epoll_ctl(hEpoll, pnode->nSocketEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+            {
+                LogPrintf("socket epoll_ctl error %d\n", errno);
+                pnode->fDisconnect = true;
+                continue;
+            }
+            pnode->nSocketEvents = nEvents;
+        }
+    }
+
+    struct epoll_event vEvents[256];
+    int nEvents = epoll_wait(hEpoll, vEvents, 256, fMoreWork ? 0 : 50);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("socket epoll_wait error %d\n", errno);
+            MilliSleep(50);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        void* ptr = vEvents[i].data.ptr;
+        if (ptr == &hEpollWakeup)
+        {
+            uint64_t nCount;
+            if (read(hEpollWakeup, &nCount, sizeof(nCount)) != sizeof(nCount) && errno != EAGAIN)
+                LogPrintf("socket events wakeup read failed %d\n", errno);
+        }
+        else if (!vhListenSocket.empty() && ptr >= (void*)&vhListenSocket.front() && ptr <= (void*)&vhListenSocket.back())
+        {
+            vAcceptReady.push_back(*(SOCKET*)ptr);
+        }
+        else
+        {
+            CNode* pnode = (CNode*)ptr;
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketReadable = true;
+            if (vEvents[i].events & EPOLLOUT)
+                pnode->fSocketWritable = true;
+        }
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fMoreWork = false;
     while (true)
     {
         //
@@ -1042,144 +1498,23 @@ void ThreadSocketHandler()
 
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        vector<SOCKET> vAcceptReady;
+#ifdef USE_EPOLL
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(vAcceptReady, fMoreWork);
+        else
+#endif
+            SocketEventsSelect(vAcceptReady);
+        fMoreWork = false;
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                // According to the internet TCP_NODELAY is not carried into accepted sockets
-                // on all platforms.  Set it again here just to be sure.
-                int set = 1;
-#ifdef WIN32
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&set, sizeof(int));
-#else
-                setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (void*)&set, sizeof(int));
-#endif
-
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+        BOOST_FOREACH(SOCKET hListenSocket, vAcceptReady)
+            AcceptConnection(hListenSocket);
 
 
         //
@@ -1201,7 +1536,12 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fRecv = pnode->fSocketReadable;
+            // select() only reports sockets it was asked about; apply the
+            // same policy to the edges epoll has kept for us
+            if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+                fRecv = fRecv && !NodeWantsSend(pnode) && NodeWantsRecv(pnode);
+            if (fRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1215,10 +1555,17 @@ void ThreadSocketHandler()
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // A short read drained the socket; a full one may have left more
+                        if (nBytes < (int)sizeof(pchBuf))
+                            pnode->fSocketReadable = false;
+                        else
+                            fMoreWork = true;
                         if (nBytes > 0)
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (pnode->vRecvMsg.front().complete())
+                                WakeMessageHandlers();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
@@ -1250,11 +1597,16 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+                    // Anything left means the socket is full again
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                }
             }
 
             //
@@ -1483,11 +1835,25 @@ void ThreadDNSAddressSeed()
 
 
 
-void DumpAddresses()
+// Append the addresses changed since the last dump to peers.log, rewriting
+// peers.dat in full only at shutdown or once the journal outgrows it
+void DumpAddresses(bool fSnapshot = false)
 {
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
+    if (!fSnapshot && adb.CanAppend())
+    {
+        vector<CAddrJournalEntry> vChanges;
+        addrman.TakeChanges(vChanges);
+        if (vChanges.empty() || adb.Append(vChanges))
+        {
+            LogPrint("net", "Appended %d changed addresses to peers.log  %dms\n",
+                   vChanges.size(), GetTimeMillis() - nStart);
+            return;
+        }
+    }
+
     adb.Write(addrman);
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
@@ -1762,6 +2128,34 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+unsigned int FinishMessageHeader(CDataStream& ssMsg)
+{
+    // Set the size
+    unsigned int nSize = ssMsg.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMsg[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash_bmw512(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ssMsg.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMsg[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    return nSize;
+}
+
+void WakeMessageHandlers()
+{
+    condMsgProc.notify_all();
+}
+
+// Wait up to nMilliseconds for the socket thread to queue a new message
+static void WaitForMessages(int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+    condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1800,7 +2194,7 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    if (!g_signals.ProcessMessages(pnode))
+                    if (!g_signals.ProcessMessages(pnode, false))
                     {
                         pnode->CloseSocketDisconnect();
                     }
@@ -1845,7 +2239,61 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            MilliSleep(100);
+            WaitForMessages(100);
+    }
+}
+
+// Processes the peer-local commands at the head of each node's receive
+// queue, so pings and address relay are not held up behind a node whose
+// block or transaction ThreadMessageHandler is busy with. Holding the node's
+// receive lock keeps its messages in order. The send lock is not held: the
+// addr handler takes cs_vNodes, which ThreadMessageHandler may hold while
+// it waits for this node's send lock. Handlers lock what they share with
+// SendMessages themselves.
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        bool fSleep = true;
+
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect)
+                continue;
+
+            // Until the version is processed everything goes through ThreadMessageHandler
+            if (!pnode->fSuccessfullyConnected)
+                continue;
+
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (!lockRecv || pnode->vRecvMsg.empty() || !pnode->vRecvMsg[0].complete())
+                continue;
+
+            size_t nQueued = pnode->vRecvMsg.size();
+            if (!g_signals.ProcessMessages(pnode, true))
+                pnode->CloseSocketDisconnect();
+            if (pnode->vRecvMsg.size() < nQueued)
+                fSleep = false;
+            boost::this_thread::interruption_point();
+        }
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        if (fSleep)
+            WaitForMessages(100);
     }
 }
 
@@ -2053,6 +2501,21 @@ void StartNode(boost::thread_group& threadGroup)
     MapPort(GetBoolArg("-upnp", USE_UPNP));
 #endif
 
+#ifdef USE_EPOLL
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1 && !InitSocketEventsEpoll())
+    {
+        LogPrintf("Falling back to select() for socket events\n");
+        ShutdownSocketEventsEpoll();
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        // Same limit AppInit2 applies when select() is chosen
+        if (nMaxConnections > FD_SETSIZE - 64)
+        {
+            nMaxConnections = FD_SETSIZE - 64;
+            LogPrintf("-maxconnections reduced to %d, the limit of select()\n", nMaxConnections);
+        }
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -2064,6 +2527,8 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpData, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -2079,7 +2544,7 @@ bool StopNode()
             semOutbound->post();
     DumpData();
     MilliSleep(50);
-    DumpAddresses();
+    DumpAddresses(true);
     return true;
 }
 
@@ -2099,6 +2564,9 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        ShutdownSocketEventsEpoll();
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -2131,6 +2599,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+    CSerializeDataPtr pmsg = SerializeMessage("tx", ss);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -2141,7 +2610,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, pmsg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -2151,6 +2620,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CSerializeDataPtr pmsg = SerializeMessage("txlreq", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -2159,7 +2629,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushSerializedMessage("txlreq", pmsg);
     }
 
 }
@@ -2195,6 +2665,94 @@ uint64_t CNode::GetTotalBytesSent()
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
+    pathJournal = GetDataDir() / "peers.log";
+}
+
+bool CAddrDB::CanAppend()
+{
+    try {
+        if (!boost::filesystem::exists(pathAddr))
+            return false;
+        if (!boost::filesystem::exists(pathJournal))
+            return true;
+        return boost::filesystem::file_size(pathJournal) < boost::filesystem::file_size(pathAddr);
+    }
+    catch (boost::filesystem::filesystem_error &e) {
+        return false;
+    }
+}
+
+bool CAddrDB::Append(const vector<CAddrJournalEntry>& vChanges)
+{
+    // Each batch is its size, the network magic and the entries, then a
+    // checksum, so a batch torn by a crash is detected and dropped
+    CDataStream ssBatch(SER_DISK, CLIENT_VERSION);
+    ssBatch << FLATDATA(Params().MessageStart());
+    ssBatch << vChanges;
+    uint256 hash = Hash(ssBatch.begin(), ssBatch.end());
+    ssBatch << hash;
+
+    FILE *file = fopen(pathJournal.string().c_str(), "ab");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CAddrDB::Append() : open failed");
+
+    // The journal is not synced: addresses lost in a crash are relearned
+    try {
+        fileout << (unsigned int)ssBatch.size();
+        fileout.write(&ssBatch[0], ssBatch.size());
+    }
+    catch (std::exception &e) {
+        return error("CAddrDB::Append() : I/O error");
+    }
+    fflush(fileout);
+    fileout.fclose();
+
+    return true;
+}
+
+bool CAddrDB::ReadJournal(CAddrMan& addr)
+{
+    FILE *file = fopen(pathJournal.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nBatches = 0;
+    while (true)
+    {
+        vector<CAddrJournalEntry> vChanges;
+        try {
+            unsigned int nSize = 0;
+            filein >> nSize;
+            if (nSize < sizeof(uint256) || nSize > MAX_SIZE)
+                break;
+            vector<char> vchBatch(nSize);
+            filein.read(&vchBatch[0], nSize);
+
+            CDataStream ssBatch(&vchBatch[0], &vchBatch[0] + nSize - sizeof(uint256), SER_DISK, CLIENT_VERSION);
+            uint256 hashIn;
+            memcpy(&hashIn, &vchBatch[nSize - sizeof(uint256)], sizeof(hashIn));
+            if (hashIn != Hash(ssBatch.begin(), ssBatch.end()))
+                break;
+
+            unsigned char pchMsgTmp[4];
+            ssBatch >> FLATDATA(pchMsgTmp);
+            if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+                break;
+            ssBatch >> vChanges;
+        }
+        catch (std::exception &e) {
+            // end of the journal, or a batch cut short
+            break;
+        }
+        addr.ApplyChanges(vChanges);
+        nBatches++;
+    }
+    filein.fclose();
+
+    LogPrint("net", "Replayed %d batches of address changes from peers.log\n", nBatches);
+    return true;
 }
 
 bool CAddrDB::Write(const CAddrMan& addr)
@@ -2232,6 +2790,9 @@ bool CAddrDB::Write(const CAddrMan& addr)
     if (!RenameOver(pathTmp, pathAddr))
         return error("CAddrman::Write() : Rename-into-place failed");
 
+    // the snapshot includes every change in the journal
+    boost::filesystem::remove(pathJournal);
+
     return true;
 }
 
@@ -2288,6 +2849,9 @@ bool CAddrDB::Read(CAddrMan& addr)
         return error("CAddrman::Read() : I/O error or stream data corrupted");
     }
 
+    // then the changes made since
+    ReadJournal(addr);
+
     return true;
 }
 
@@ -5,8 +5,10 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "bloom.h"
 #include "compat.h"
 #include "chain.h"
+#include "crypto/bmw/bmw512.h"
 #include "hash.h"
 #include "limitedmap.h"
 #include "mruset.h"
@@ -25,10 +27,12 @@
 
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
 class CAddrMan;
+class CAddrJournalEntry;
 class CBlockIndex;
 extern int nBestHeight;
 
@@ -57,11 +61,18 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** The number of recent inventory items remembered per peer, so they aren't announced to it */
+static const unsigned int MAX_INVENTORY_KNOWN = 10000;
+/** Average delay between transaction announcements to an inbound peer, in seconds.
+ *  Outbound peers get half of it. */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
 void AddOneShot(std::string strDest);
+/** The time, in microseconds, of an event after nNow in a Poisson process of the given average interval */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
@@ -75,6 +86,26 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+void WakeMessageHandlers();
+/** Fill in the size and checksum of a message serialized after its CMessageHeader; returns the payload size */
+unsigned int FinishMessageHeader(CDataStream& ssMsg);
+
+/** A complete message queued for sending, shared by all nodes it is sent to */
+typedef boost::shared_ptr<const CSerializeData> CSerializeDataPtr;
+/** An empty send buffer, recycled with its capacity once nothing refers to it */
+boost::shared_ptr<CSerializeData> AllocSendBuffer();
+
+/** Serialize a message once so it can be queued on many nodes with PushSerializedMessage */
+template<typename T>
+CSerializeDataPtr SerializeMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader(pszCommand, 0) << obj;
+    FinishMessageHeader(ssMsg);
+    boost::shared_ptr<CSerializeData> pmsg = AllocSendBuffer();
+    ssMsg.SwapAndClear(*pmsg);
+    return pmsg;
+}
 void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
@@ -83,7 +114,7 @@ typedef int NodeId;
 struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
-    boost::signals2::signal<bool (CNode*)> ProcessMessages;
+    boost::signals2::signal<bool (CNode*, bool)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
@@ -138,9 +169,27 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
 
+/** How ThreadSocketHandler waits for socket readiness (-socketevents) */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+#ifdef USE_EPOLL
+static const char DEFAULT_SOCKETEVENTS[] = "epoll";
+#else
+static const char DEFAULT_SOCKETEVENTS[] = "select";
+#endif
+extern SocketEventsMode nSocketEventsMode;
+
+/** Threads that process peer-local messages next to ThreadMessageHandler (-msghandlers) */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+static const int MAX_MSGHANDLER_THREADS = 16;
+extern int nMessageHandlerThreads;
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializeDataPtr> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -194,20 +243,25 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdrBuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CBMW512 hasher;                 // hashes the data as it arrives
+    uint256 hashData;               // hash of the data, once complete
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
     }
 
+    // Returns the receive buffer to the pool
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -217,7 +271,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -295,9 +348,15 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeDataPtr> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Edge-triggered readiness reported by epoll, kept until it is used up
+    bool fSocketReadable;
+    bool fSocketWritable;
+    // Events hSocket is registered for with epoll, 0 if not registered
+    uint32_t nSocketEvents;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -349,17 +408,21 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    // Whether the peer asked for new blocks to be pushed as compact blocks (sendcmpct)
+    bool fSendCompactBlocks;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    int64_t nNextInvSend; // when transaction inventory is next announced
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -374,7 +437,7 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(MAX_INVENTORY_KNOWN, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -399,15 +462,19 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketReadable = false;
+        fSocketWritable = false;
+        nSocketEvents = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fSendCompactBlocks = false;
         fGetAddr = false;
         fRelayTxes = false; // TODO: reference this again
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
@@ -491,6 +558,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -499,6 +567,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -513,7 +582,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash, inv.type);
         }
     }
 
@@ -521,7 +590,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash, inv.type))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -597,22 +666,16 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash_bmw512(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        unsigned int nSize = FinishMessageHeader(ssSend);
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        // The message keeps the bytes serialized into ssSend, and ssSend
+        // continues in the recycled buffer
+        boost::shared_ptr<CSerializeData> pmsg = AllocSendBuffer();
+        ssSend.SwapAndClear(*pmsg);
+        std::deque<CSerializeDataPtr>::iterator it = vSendMsg.insert(vSendMsg.end(), pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
         if (it == vSendMsg.begin())
@@ -621,6 +684,21 @@ public:
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message that was completed with FinishMessageHeader earlier,
+    // without serializing, checksumming or copying it again
+    void PushSerializedMessage(const char* pszCommand, const CSerializeDataPtr& pmsg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: %s (%d bytes, serialized)\n", pszCommand, pmsg->size() - CMessageHeader::HEADER_SIZE);
+
+        std::deque<CSerializeDataPtr>::iterator it = vSendMsg.insert(vSendMsg.end(), pmsg);
+        nSendSize += pmsg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (it == vSendMsg.begin())
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -912,10 +990,16 @@ class CAddrDB
 {
 private:
     boost::filesystem::path pathAddr;
+    boost::filesystem::path pathJournal; // changes since peers.dat was written (peers.log)
+
+    bool ReadJournal(CAddrMan& addr);
 public:
     CAddrDB();
     bool Write(const CAddrMan& addr);
     bool Read(CAddrMan& addr);
+    // Whether changes should go to the journal rather than a new peers.dat
+    bool CanAppend();
+    bool Append(const std::vector<CAddrJournalEntry>& vChanges);
 };
 
 /** Access to the banlist database (banlist.dat) */
@@ -5,6 +5,7 @@
 
 #include "rpcserver.h"
 #include "main.h"
+#include "txmempool.h"
 #include "kernel.h"
 #include "checkpoints.h"
 
@@ -9,6 +9,7 @@
 #include "main.h"
 #include "db.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "init.h"
 #include "miner.h"
 #include "kernel.h"
@@ -243,6 +244,7 @@ Value checkkernel(const Array& params, bool fHelp)
     #endif
 
     pblock->nTime = pblock->vtx[0].nTime = nTime;
+    pblock->vtx[0].InvalidateCache();
 
     CDataStream ss(SER_DISK, PROTOCOL_VERSION);
     ss << *pblock;
@@ -377,7 +379,10 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nNonce = pdata->nNonce;
 
         if(coinbase.size() == 0)
+        {
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+            pblock->vtx[0].InvalidateCache();
+        }
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
@@ -497,6 +502,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].InvalidateCache();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         assert(pwalletMain != NULL);
@@ -2517,14 +2517,11 @@ Value scanforalltxns(const Array& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
 
-    {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-
-        pwalletMain->MarkDirty();
+    pwalletMain->MarkDirty();
 
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+    // The rescan takes the locks a batch of blocks at a time
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    pwalletMain->ReacceptWalletTransactions();
 
     result.push_back(Pair("result", "Scan complete."));
 
@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -2088,7 +2086,9 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    bool fSigned = Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType);
+    txTo.InvalidateCache();
+    if (!fSigned)
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -2106,6 +2106,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
         txin.scriptSig << static_cast<valtype>(subscript);
+        txTo.InvalidateCache();
         if (!fSolved) return false;
     }
 
@@ -2129,56 +2130,87 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// An entry is a salted SHA256 of (signature hash, signature, public key),
+// 32 bytes, kept in a fixed table sized by -maxsigcachesize megabytes.
+// The salt keeps attackers from predicting where an entry lands. The table
+// is split into buckets of SIGCACHE_WAYS slots, and the buckets into
+// SIGCACHE_SHARDS lock shards, so lookups from different threads rarely
+// touch the same lock and never wait for each other.
+
+static const unsigned int SIGCACHE_WAYS = 4;
+static const unsigned int SIGCACHE_SHARDS = 64;
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    uint256 nonce;
+    std::vector<uint256> vEntries;
+    uint64_t nBuckets;
+    boost::shared_mutex csShard[SIGCACHE_SHARDS];
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 entry;
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size()).Write(pubKey.begin(), pubKey.size()).Finalize(entry.begin());
+        return entry;
+    }
 
 public:
+    CSignatureCache()
+    {
+        nonce = GetRandHash();
+        int64_t nMaxCacheMB = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE));
+        if (nMaxCacheMB > MAX_MAX_SIG_CACHE_SIZE)
+        {
+            LogPrintf("-maxsigcachesize=%d is in megabytes, using %u\n", nMaxCacheMB, MAX_MAX_SIG_CACHE_SIZE);
+            nMaxCacheMB = MAX_MAX_SIG_CACHE_SIZE;
+        }
+        int64_t nMaxCacheSize = nMaxCacheMB * 1000000;
+        nBuckets = nMaxCacheSize / (sizeof(uint256) * SIGCACHE_WAYS);
+        vEntries.resize(nBuckets * SIGCACHE_WAYS);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nBuckets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        uint64_t nBucket = entry.Get64(0) % nBuckets;
+        boost::shared_lock<boost::shared_mutex> lock(csShard[nBucket % SIGCACHE_SHARDS]);
+
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
+            if (vEntries[nBucket * SIGCACHE_WAYS + i] == entry)
+                return true;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nBuckets == 0)
+            return;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        uint64_t nBucket = entry.Get64(0) % nBuckets;
+        boost::unique_lock<boost::shared_mutex> lock(csShard[nBucket % SIGCACHE_SHARDS]);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        uint256* pslot = &vEntries[nBucket * SIGCACHE_WAYS];
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pslot[i] == entry)
+                return;
+            if (pslot[i] == 0)
+            {
+                pslot[i] = entry;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket is full: overwrite a slot picked by salted bits of the
+        // entry, which attackers cannot aim at
+        pslot[entry.Get64(1) % SIGCACHE_WAYS] = entry;
     }
 };
 
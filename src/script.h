@@ -93,6 +93,11 @@ enum
     SIGHASH_ANYONECANPAY = 0x80,
 };
 
+/** Default for -maxsigcachesize, megabytes of verified signatures to remember */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Largest -maxsigcachesize used; the option used to count entries, so old values can be huge */
+static const unsigned int MAX_MAX_SIG_CACHE_SIZE = 1024;
+
 /** Script verification flags */
 enum
 {
@@ -992,6 +992,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -1186,6 +1187,16 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Move the contents into data without copying them. The stream takes
+    // data's storage in exchange, emptied, and reuses its capacity.
+    void SwapAndClear(CSerializeData &data) {
+        if (nReadPos != 0)
+            vch.erase(vch.begin(), vch.begin() + nReadPos);
+        data.clear();
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -7,9 +7,8 @@
 
 
 #include <openssl/rand.h>
-#include <openssl/ec.h>
-#include <openssl/ecdsa.h>
-#include <openssl/obj_mac.h>
+
+#include <boost/thread/once.hpp>
 
 
 bool CStealthAddress::SetEncoded(const std::string& encodedAddress)
@@ -164,56 +163,76 @@ int GenerateRandomSecret(ec_secret& out)
     return 0;
 };
 
+// Created on first use and kept for the life of the process, as building
+// its multiplication tables costs far more than a stealth operation
+static secp256k1_context* secp256k1_context_stealth = NULL;
+static boost::once_flag stealthContextOnce = BOOST_ONCE_INIT;
+
+static void StealthContextInit()
+{
+    secp256k1_context* ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+    assert(ctx != NULL);
+
+    // -- blind the precomputed tables of G, as key.cpp does
+    unsigned char seed[32];
+    GetRandBytes(seed, sizeof(seed));
+    bool ret = secp256k1_context_randomize(ctx, seed);
+    assert(ret);
+
+    secp256k1_context_stealth = ctx;
+}
+
+static const secp256k1_context* StealthContext()
+{
+    boost::call_once(StealthContextInit, stealthContextOnce);
+    return secp256k1_context_stealth;
+}
+
+static int StealthParse(const ec_point& point, secp256k1_pubkey& pubkeyOut)
+{
+    if (point.empty()
+        || !secp256k1_ec_pubkey_parse(StealthContext(), &pubkeyOut, &point[0], point.size()))
+        return 1;
+    return 0;
+}
+
+static int StealthSerialize(const secp256k1_pubkey& pubkey, ec_point& out)
+{
+    size_t nSize = ec_compressed_size;
+    out.resize(ec_compressed_size);
+    secp256k1_ec_pubkey_serialize(StealthContext(), &out[0], &nSize, &pubkey, SECP256K1_EC_COMPRESSED);
+    return nSize == ec_compressed_size ? 0 : 1;
+}
+
+// -- c = H(secret * point)
+static int StealthShared(const ec_secret& secret, secp256k1_pubkey point, ec_secret& sharedSOut)
+{
+    ec_point vchOut;
+    if (!secp256k1_ec_pubkey_tweak_mul(StealthContext(), &point, &secret.e[0])
+        || StealthSerialize(point, vchOut) != 0)
+        return 1;
+
+    SHA256(&vchOut[0], vchOut.size(), &sharedSOut.e[0]);
+    return 0;
+}
+
 int SecretToPublicKey(const ec_secret& secret, ec_point& out)
 {
     // -- public key = private * G
-    int rv = 0;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey pubkey;
+    if (!secp256k1_ec_pubkey_create(StealthContext(), &pubkey, &secret.e[0]))
     {
-        LogPrintf("SecretToPublicKey(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("SecretToPublicKey(): secp256k1_ec_pubkey_create failed.\n");
         return 1;
     };
 
-    BIGNUM* bnIn = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new());
-    if (!bnIn)
+    if (StealthSerialize(pubkey, out) != 0)
     {
-        EC_GROUP_free(ecgrp);
-        LogPrintf("SecretToPublicKey(): BN_bin2bn failed\n");
+        LogPrintf("SecretToPublicKey(): pubkey incorrect length.\n");
         return 1;
     };
-    
-    EC_POINT* pub = EC_POINT_new(ecgrp);
-    
-    
-    EC_POINT_mul(ecgrp, pub, bnIn, NULL, NULL, NULL);
-    
-    BIGNUM* bnOut = EC_POINT_point2bn(ecgrp, pub, POINT_CONVERSION_COMPRESSED, BN_new(), NULL);
-    if (!bnOut)
-    {
-        LogPrintf("SecretToPublicKey(): point2bn failed\n");
-        rv = 1;
-    } else
-    {
-        out.resize(ec_compressed_size);
-        if (BN_num_bytes(bnOut) != (int) ec_compressed_size
-            || BN_bn2bin(bnOut, &out[0]) != (int) ec_compressed_size)
-        {
-            LogPrintf("SecretToPublicKey(): bnOut incorrect length.\n");
-            rv = 1;
-        };
-        
-        BN_free(bnOut);
-    };
-    
 
-    EC_POINT_free(pub);
-    BN_free(bnIn);
-    EC_GROUP_free(ecgrp);
-
-    return rv;
+    return 0;
 };
 
 
@@ -245,180 +264,38 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
     
     
     Recipient gets R' and P
-    
-    test 0 and infinity?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutQ;
-    
-    BN_CTX* bnCtx   = NULL;
-    BIGNUM* bnEphem = NULL;
-    BIGNUM* bnQ     = NULL;
-    EC_POINT* Q     = NULL;
-    BIGNUM* bnOutQ  = NULL;
-    BIGNUM* bnc     = NULL;
-    EC_POINT* C     = NULL;
-    BIGNUM* bnR     = NULL;
-    EC_POINT* R     = NULL;
-    EC_POINT* Rout  = NULL;
-    BIGNUM* bnOutR  = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey Q;
+    if (StealthParse(pubkey, Q) != 0)
     {
-        LogPrintf("StealthSecret(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecret(): Q secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecret(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnEphem = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnEphem BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnQ = BN_bin2bn(&pubkey[0], pubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnQ BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Q = EC_POINT_bn2point(ecgrp, bnQ, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
     // -- eQ
-    // EC_POINT_mul(const EC_GROUP *group, EC_POINT *r, const BIGNUM *n, const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx);
-    // EC_POINT_mul calculates the value generator * n + q * m and stores the result in r. The value n may be NULL in which case the result is just q * m. 
-    if (!EC_POINT_mul(ecgrp, Q, NULL, Q, bnEphem, bnCtx))
-    {
-        LogPrintf("StealthSecret(): eQ EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutQ = EC_POINT_point2bn(ecgrp, Q, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutQ.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutQ) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutQ, &vchOutQ[0]) != (int) ec_compressed_size)
-    {
-        LogPrintf("StealthSecret(): bnOutQ incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    SHA256(&vchOutQ[0], vchOutQ.size(), &sharedSOut.e[0]);
-    
-    if (!(bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- cG
-    if (!(C = EC_POINT_new(ecgrp)))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnR = BN_bin2bn(&pkSpend[0], pkSpend.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnR BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    if (!(R = EC_POINT_bn2point(ecgrp, bnR, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecret(): R EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        printf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Rout = EC_POINT_new(ecgrp)))
-    {
-        printf("StealthSecret(): Rout EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_add(ecgrp, Rout, R, C, bnCtx))
+    if (StealthShared(secret, Q, sharedSOut) != 0)
     {
-        LogPrintf("StealthSecret(): Rout EC_POINT_add failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): eQ secp256k1_ec_pubkey_tweak_mul failed\n");
+        return 1;
     };
     
-    if (!(bnOutR = EC_POINT_point2bn(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
+    secp256k1_pubkey R;
+    if (StealthParse(pkSpend, R) != 0)
     {
-        LogPrintf("StealthSecret(): Rout EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): R secp256k1_ec_pubkey_parse failed\n");
+        return 1;
     };
     
-    
-    pkOut.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutR) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutR, &pkOut[0]) != (int) ec_compressed_size)
+    // -- R + cG
+    if (!secp256k1_ec_pubkey_tweak_add(StealthContext(), &R, &sharedSOut.e[0])
+        || StealthSerialize(R, pkOut) != 0)
     {
-        LogPrintf("StealthSecret(): pkOut incorrect length.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): Rout secp256k1_ec_pubkey_tweak_add failed\n");
+        return 1;
     };
     
-    End:
-    if (bnOutR)     BN_free(bnOutR);
-    if (Rout)       EC_POINT_free(Rout);
-    if (R)          EC_POINT_free(R);
-    if (bnR)        BN_free(bnR);
-    if (C)          EC_POINT_free(C);
-    if (bnc)        BN_free(bnc);
-    if (bnOutQ)     BN_free(bnOutQ);
-    if (Q)          EC_POINT_free(Q);
-    if (bnQ)        BN_free(bnQ);
-    if (bnEphem)    BN_free(bnEphem);
-    if (bnCtx)      BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 
@@ -429,230 +306,77 @@ int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret&
     c  = H(dP)
     R' = R + cG     [without decrypting wallet]
        = (f + c)G   [after decryption of wallet]
-         Remember: mod curve.order, pad with 0x00s where necessary?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnScanSecret    = NULL;
-    BIGNUM* bnP             = NULL;
-    EC_POINT* P             = NULL;
-    BIGNUM* bnOutP          = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey P;
+    if (StealthParse(ephemPubkey, P) != 0)
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecretSpend(): P secp256k1_ec_pubkey_parse failed\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnScanSecret = BN_bin2bn(&scanSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnScanSecret BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnP = BN_bin2bn(&ephemPubkey[0], ephemPubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnP BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(P = EC_POINT_bn2point(ecgrp, bnP, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
     // -- dP
-    if (!EC_POINT_mul(ecgrp, P, NULL, P, bnScanSecret, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): dP EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutP = EC_POINT_point2bn(ecgrp, P, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutP.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutP) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutP, &vchOutP[0]) != (int) ec_compressed_size)
-    {
-        LogPrintf("StealthSecretSpend(): bnOutP incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    uint8_t hash1[32];
-    SHA256(&vchOutP[0], vchOutP.size(), (uint8_t*)hash1);
-    
-    
-    if (!(bnc = BN_bin2bn(&hash1[0], 32, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
+    ec_secret sShared;
+    if (StealthShared(scanSecret, P, sShared) != 0)
     {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecretSpend(): dP secp256k1_ec_pubkey_tweak_mul failed\n");
+        return 1;
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnOutP)         BN_free(bnOutP);
-    if (P)              EC_POINT_free(P);
-    if (bnP)            BN_free(bnP);
-    if (bnScanSecret)   BN_free(bnScanSecret);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return StealthSharedToSecretSpend(sShared, spendSecret, secretOut);
 };
 
 
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut)
 {
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    // -- f + c mod curve.order, fails if the sum is zero
+    secretOut = spendSecret;
+    if (!secp256k1_ec_privkey_tweak_add(StealthContext(), &secretOut.e[0], &sharedS.e[0]))
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSharedToSecretSpend(): secp256k1_ec_privkey_tweak_add failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnc = BN_bin2bn(&sharedS.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
+    return 0;
+};
+
+
+int StealthScanKey(const CStealthAddress& sxAddr, CStealthScanKey& keyOut)
+{
+    if (sxAddr.scan_secret.size() != ec_secret_size)
+        return 1; // stealth address is not owned
     
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
+    if (!secp256k1_ec_seckey_verify(StealthContext(), &sxAddr.scan_secret[0])
+        || StealthParse(sxAddr.spend_pubkey, keyOut.spend_pubkey) != 0)
+        return 1;
     
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
+    memcpy(&keyOut.scan_secret.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+    keyOut.scan_pubkey = sxAddr.scan_pubkey;
+    return 0;
+};
+
+
+int StealthSecretBatch(const ec_point& ephemPubkey, const std::vector<CStealthScanKey>& vScanKeys, std::vector<ec_secret>& vSharedOut, std::vector<ec_point>& vPkOut)
+{
+    // -- P is parsed once, then for each scan key c = H(dP), R' = R + cG
+    secp256k1_pubkey P;
+    if (StealthParse(ephemPubkey, P) != 0)
+        return 1;
     
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
+    vSharedOut.resize(vScanKeys.size());
+    vPkOut.assign(vScanKeys.size(), ec_point());
+    for (size_t i = 0; i < vScanKeys.size(); ++i)
     {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        if (StealthShared(vScanKeys[i].scan_secret, P, vSharedOut[i]) != 0)
+            continue;
+        
+        secp256k1_pubkey R = vScanKeys[i].spend_pubkey;
+        if (!secp256k1_ec_pubkey_tweak_add(StealthContext(), &R, &vSharedOut[i].e[0])
+            || StealthSerialize(R, vPkOut[i]) != 0)
+            vPkOut[i].clear();
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 bool IsStealthAddress(const std::string& encodedAddress)
@@ -14,6 +14,8 @@
 #include "serialize.h"
 #include "key.h"
 
+#include <secp256k1.h>
+
 
 typedef std::vector<uint8_t> data_chunk;
 
@@ -113,6 +115,20 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut);
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut);
 
+/** The keys of an owned stealth address, parsed once for scanning */
+struct CStealthScanKey
+{
+    ec_point scan_pubkey;
+    ec_secret scan_secret;
+    secp256k1_pubkey spend_pubkey;
+};
+
+int StealthScanKey(const CStealthAddress& sxAddr, CStealthScanKey& keyOut);
+
+// For each scan key, the shared secret and the one-time public key a payment
+// with ephemPubkey to its address pays; vPkOut[i] is empty where that fails
+int StealthSecretBatch(const ec_point& ephemPubkey, const std::vector<CStealthScanKey>& vScanKeys, std::vector<ec_secret>& vSharedOut, std::vector<ec_point>& vPkOut);
+
 bool IsStealthAddress(const std::string& encodedAddress);
 
 
@@ -0,0 +1,65 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "addrman.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress MakeAddr(const char* pszAddr)
+{
+    CAddress addr(CService(pszAddr, 8333));
+    addr.nTime = GetAdjustedTime() - 3600;
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_journal_replay)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.1.1");
+
+    for (int i = 1; i <= 20; i++)
+        addrman.Add(MakeAddr(strprintf("250.%d.1.1", i).c_str()), source);
+    addrman.Good(MakeAddr("250.1.1.1"));
+
+    // snapshot, as written to peers.dat
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+
+    // nothing changed since the snapshot
+    vector<CAddrJournalEntry> vChanges;
+    addrman.TakeChanges(vChanges);
+    BOOST_CHECK(vChanges.empty());
+
+    addrman.Add(MakeAddr("250.21.1.1"), source);
+    addrman.Good(MakeAddr("250.2.1.1"));
+    addrman.Attempt(MakeAddr("250.3.1.1"));
+    addrman.TakeChanges(vChanges);
+    BOOST_CHECK_EQUAL(vChanges.size(), 3U);
+
+    // changes are reported once
+    vector<CAddrJournalEntry> vNone;
+    addrman.TakeChanges(vNone);
+    BOOST_CHECK(vNone.empty());
+
+    // as appended to peers.log
+    CDataStream ssJournal(SER_DISK, CLIENT_VERSION);
+    ssJournal << vChanges;
+
+    CAddrMan addrman2;
+    ssPeers >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), 20);
+
+    vector<CAddrJournalEntry> vReplay;
+    ssJournal >> vReplay;
+    addrman2.ApplyChanges(vReplay);
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    // replayed changes are already stored
+    addrman2.TakeChanges(vNone);
+    BOOST_CHECK(vNone.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
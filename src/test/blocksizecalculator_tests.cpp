@@ -0,0 +1,87 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "blocksizecalculator.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blocksizecalculator_tests)
+
+static vector<CBlockIndex*> MakeChain(CBlockIndex* pindexFork, int nHeight, unsigned int nBlocks, unsigned int nSeed)
+{
+    vector<CBlockIndex*> vChain;
+    CBlockIndex* pprev = pindexFork;
+    for (unsigned int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->pprev = pprev;
+        pindex->nHeight = nHeight + i;
+        pindex->nBlockSize = 1000 + ((i + 1) * nSeed) % 997;
+        vChain.push_back(pindex);
+        pprev = pindex;
+    }
+    return vChain;
+}
+
+static unsigned int SlowMedian(CBlockIndex* pindex, unsigned int nBlocks)
+{
+    vector<unsigned int> vSizes;
+    for (; pindex && pindex->nHeight > 0 && vSizes.size() < nBlocks; pindex = pindex->pprev)
+        vSizes.push_back(pindex->nBlockSize);
+    if (vSizes.size() != nBlocks)
+        return 0;
+    sort(vSizes.begin(), vSizes.end());
+    if (nBlocks % 2)
+        return vSizes[nBlocks / 2];
+    return ((uint64_t)vSizes[nBlocks / 2 - 1] + vSizes[nBlocks / 2]) / 2;
+}
+
+BOOST_AUTO_TEST_CASE(median_across_reorg)
+{
+    LOCK(cs_main);
+
+    CBlockIndex genesis;
+    vector<CBlockIndex*> vMain = MakeChain(&genesis, 1, 80, 37);
+    vector<CBlockIndex*> vSide = MakeChain(vMain[49], 51, 20, 101);
+
+    const unsigned int vWindows[] = { 25, 24 };
+    BOOST_FOREACH(unsigned int nBlocks, vWindows)
+    {
+        // Connect the main chain, back off to the fork and connect the side chain
+        vector<CBlockIndex*> vPath(vMain.begin(), vMain.end());
+        for (int i = 78; i >= 49; i--)
+            vPath.push_back(vMain[i]);
+        vPath.insert(vPath.end(), vSide.begin(), vSide.end());
+
+        BOOST_FOREACH(CBlockIndex* pindex, vPath)
+            BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex, nBlocks), SlowMedian(pindex, nBlocks));
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vMain)
+        delete pindex;
+    BOOST_FOREACH(CBlockIndex* pindex, vSide)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(median_alternating_windows)
+{
+    LOCK(cs_main);
+
+    CBlockIndex genesis;
+    vector<CBlockIndex*> vMain = MakeChain(&genesis, 1, 60, 53);
+
+    // Calls for different window lengths interleave along the chain
+    BOOST_FOREACH(CBlockIndex* pindex, vMain)
+    {
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex, 11), SlowMedian(pindex, 11));
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex, 30), SlowMedian(pindex, 30));
+        BOOST_CHECK_EQUAL(BlockSizeCalculator::GetMedianBlockSize(pindex->pprev, 11), SlowMedian(pindex->pprev, 11));
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vMain)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
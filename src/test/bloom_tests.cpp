@@ -0,0 +1,51 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive
+    CRollingBloomFilter rb(100, 0.01);
+
+    vector<uint256> vData;
+    for (int i = 0; i < 399; i++)
+        vData.push_back(GetRandHash());
+
+    // Overfill
+    for (int i = 0; i < 399; i++)
+        rb.insert(vData[i]);
+
+    // The last 100 are still contained
+    for (int i = 299; i < 399; i++)
+        BOOST_CHECK(rb.contains(vData[i]));
+
+    // And the first few are not, up to the false positive rate
+    int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            nHits++;
+    BOOST_CHECK(nHits <= 200);
+
+    // A domain is a different set
+    int nDomainHits = 0;
+    for (int i = 299; i < 399; i++)
+        if (rb.contains(vData[i], 1))
+            nDomainHits++;
+    BOOST_CHECK(nDomainHits <= 10);
+
+    rb.reset();
+    nHits = 0;
+    for (int i = 0; i < 399; i++)
+        if (rb.contains(vData[i]))
+            nHits++;
+    BOOST_CHECK_EQUAL(nHits, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,46 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(bmw512_prefixed)
+{
+    // Prefix/suffix splits, including ones crossing the 128 byte block size
+    vector<unsigned char> vch(300);
+    for (unsigned int i = 0; i < vch.size(); i++)
+        vch[i] = (unsigned char)(i * 7 + 3);
+
+    for (unsigned int nLen = 0; nLen <= vch.size(); nLen += 25)
+    {
+        for (unsigned int nPrefix = 0; nPrefix <= nLen; nPrefix += 11)
+        {
+            CBMW512Prefixed hasher(&vch[0], nPrefix);
+            BOOST_CHECK(hasher.Hash(&vch[0] + nPrefix, nLen - nPrefix) == Hash_bmw512(vch.begin(), vch.begin() + nLen));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_hasher)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        uint256 bnStakeModifierV2 = GetRandHash();
+        COutPoint prevout(GetRandHash(), GetRand(100));
+        unsigned int nTimeTxPrev = GetRand(0x7fffffff);
+
+        CStakeKernelHasher hasher(bnStakeModifierV2, nTimeTxPrev, prevout);
+        for (unsigned int nTimeTx = nTimeTxPrev; nTimeTx < nTimeTxPrev + 64; nTimeTx += 16)
+        {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << bnStakeModifierV2;
+            ss << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
+            BOOST_CHECK(hasher.Hash(nTimeTx) == Hash_bmw512(ss.begin(), ss.end()));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
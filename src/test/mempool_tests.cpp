@@ -0,0 +1,110 @@
+#include <boost/test/unit_test.hpp>
+
+#include "txmempool.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction with one input spending prevout and one output
+static CTransaction MakeTx(const COutPoint& prevout)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx, int64_t nFee)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, COIN + nFee, COIN + nFee, 0, 0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_descendant_state)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeTx(COutPoint(GetRandHash(), 0));
+    CTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0));
+    CTransaction txGrandChild = MakeTx(COutPoint(txChild.GetHash(), 0));
+    AddTx(pool, txParent, 1000);
+    AddTx(pool, txChild, 2000);
+    AddTx(pool, txGrandChild, 4000);
+
+    const CTxMemPoolEntry& parent = pool.mapTx[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(parent.GetSizeWithDescendants(), (uint64_t)parent.GetTxSize() * 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[txChild.GetHash()].GetFeesWithDescendants(), 6000);
+
+    pool.remove(txGrandChild);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 3000);
+    BOOST_CHECK_EQUAL(pool.mapTx[txChild.GetHash()].GetFeesWithDescendants(), 2000);
+
+    // Added back after a reorganization, with its child already in the pool
+    AddTx(pool, txGrandChild, 4000);
+    pool.remove(txChild);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 1000);
+    AddTx(pool, txChild, 2000);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(pool.setTxByDescendantScore.size(), 3U);
+
+    pool.remove(txParent, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(pool.setTxByDescendantScore.empty());
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_package)
+{
+    CTxMemPool pool;
+
+    // A low fee parent paid for by its child, and a transaction paying in
+    // between the two
+    CTransaction txParent = MakeTx(COutPoint(GetRandHash(), 0));
+    CTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0));
+    CTransaction txOther = MakeTx(COutPoint(GetRandHash(), 0));
+    AddTx(pool, txParent, 100);
+    AddTx(pool, txChild, 100000);
+    AddTx(pool, txOther, 10000);
+
+    // The parent is ranked with its child and outlives the other transaction
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(txParent.GetHash()));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+    BOOST_CHECK(!pool.exists(txOther.GetHash()));
+
+    // Without its child it pays the least, and goes first
+    AddTx(pool, txOther, 10000);
+    pool.remove(txChild);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+
+    // Evicting a parent takes its descendants along
+    AddTx(pool, txParent, 50);
+    AddTx(pool, txChild, 200);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_confirmed_parent)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeTx(COutPoint(GetRandHash(), 0));
+    CTransaction txChild = MakeTx(COutPoint(txParent.GetHash(), 0));
+    AddTx(pool, txParent, 1000);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000, COIN + 1000, 0, 0, 100, 0));
+
+    // Its input ages from the block that confirmed the parent on
+    pool.removeConfirmed(txParent, 110);
+    const CTxMemPoolEntry& child = pool.mapTx[txChild.GetHash()];
+    BOOST_CHECK(child.setParents.empty());
+    BOOST_CHECK_CLOSE(child.GetPriority(110), 1.0 * COIN / child.GetTxSize(), 1e-6);
+    BOOST_CHECK_CLOSE(child.GetPriority(120), 11.0 * COIN / child.GetTxSize(), 1e-6);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
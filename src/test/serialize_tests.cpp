@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 
+#include "main.h"
 #include "serialize.h"
 
 using namespace std;
@@ -42,4 +43,42 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(coins)
+{
+    CTransaction tx;
+    tx.nTime = 1400000000;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(10);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        tx.vout[i].nValue = (i + 1) * COIN;
+        tx.vout[i].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    CCoins coins(tx, 12345, 1400000060);
+    coins.Spend(0);
+    coins.Spend(9);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coins;
+    CCoins coins2;
+    ss >> coins2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(coins2.nHeight, 12345);
+    BOOST_CHECK_EQUAL(coins2.nTime, tx.nTime);
+    BOOST_CHECK_EQUAL(coins2.nBlockTime, 1400000060U);
+    BOOST_CHECK(!coins2.IsCoinBase() && !coins2.IsCoinStake());
+    BOOST_CHECK_EQUAL(coins2.vout.size(), tx.vout.size());
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(coins2.IsAvailable(i), i != 0 && i != 9);
+        if (coins2.IsAvailable(i))
+            BOOST_CHECK(coins2.vout[i] == tx.vout[i]);
+    }
+    BOOST_CHECK(!coins2.IsPruned());
+    for (unsigned int i = 1; i < 9; i++)
+        coins2.Spend(i);
+    BOOST_CHECK(coins2.IsPruned());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
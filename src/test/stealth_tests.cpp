@@ -0,0 +1,86 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "stealth.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+static CStealthAddress MakeStealthAddress(ec_secret& scanSecret, ec_secret& spendSecret)
+{
+    CStealthAddress sxAddr;
+    BOOST_CHECK(GenerateRandomSecret(scanSecret) == 0);
+    BOOST_CHECK(GenerateRandomSecret(spendSecret) == 0);
+    BOOST_CHECK(SecretToPublicKey(scanSecret, sxAddr.scan_pubkey) == 0);
+    BOOST_CHECK(SecretToPublicKey(spendSecret, sxAddr.spend_pubkey) == 0);
+    sxAddr.scan_secret.assign(&scanSecret.e[0], &scanSecret.e[0] + ec_secret_size);
+    return sxAddr;
+}
+
+BOOST_AUTO_TEST_CASE(stealth_secret_spend)
+{
+    ec_secret scanSecret, spendSecret;
+    CStealthAddress sxAddr = MakeStealthAddress(scanSecret, spendSecret);
+
+    // sender pays R + H(eQ)G
+    ec_secret ephemSecret, sharedSender;
+    ec_point ephemPubkey, pkPaid;
+    BOOST_CHECK(GenerateRandomSecret(ephemSecret) == 0);
+    BOOST_CHECK(SecretToPublicKey(ephemSecret, ephemPubkey) == 0);
+    BOOST_CHECK(StealthSecret(ephemSecret, sxAddr.scan_pubkey, sxAddr.spend_pubkey, sharedSender, pkPaid) == 0);
+    BOOST_CHECK_EQUAL(pkPaid.size(), ec_compressed_size);
+
+    // recipient finds the same key with H(dP) and can spend it
+    ec_secret sharedRecipient, spendOut;
+    ec_point pkRecipient;
+    BOOST_CHECK(StealthSecret(scanSecret, ephemPubkey, sxAddr.spend_pubkey, sharedRecipient, pkRecipient) == 0);
+    BOOST_CHECK(pkRecipient == pkPaid);
+    BOOST_CHECK(memcmp(&sharedSender.e[0], &sharedRecipient.e[0], ec_secret_size) == 0);
+
+    ec_point pkSpend;
+    BOOST_CHECK(StealthSecretSpend(scanSecret, ephemPubkey, spendSecret, spendOut) == 0);
+    BOOST_CHECK(SecretToPublicKey(spendOut, pkSpend) == 0);
+    BOOST_CHECK(pkSpend == pkPaid);
+}
+
+BOOST_AUTO_TEST_CASE(stealth_secret_batch)
+{
+    vector<CStealthAddress> vAddresses;
+    vector<CStealthScanKey> vScanKeys;
+    for (int i = 0; i < 4; i++)
+    {
+        ec_secret scanSecret, spendSecret;
+        vAddresses.push_back(MakeStealthAddress(scanSecret, spendSecret));
+        CStealthScanKey scanKey;
+        BOOST_CHECK(StealthScanKey(vAddresses.back(), scanKey) == 0);
+        vScanKeys.push_back(scanKey);
+    }
+
+    // an address without its scan secret isn't ours to scan for
+    CStealthAddress sxNotOwned = vAddresses[0];
+    sxNotOwned.scan_secret.clear();
+    CStealthScanKey scanKey;
+    BOOST_CHECK(StealthScanKey(sxNotOwned, scanKey) != 0);
+
+    ec_secret ephemSecret, shared;
+    ec_point ephemPubkey, pkPaid;
+    BOOST_CHECK(GenerateRandomSecret(ephemSecret) == 0);
+    BOOST_CHECK(SecretToPublicKey(ephemSecret, ephemPubkey) == 0);
+    BOOST_CHECK(StealthSecret(ephemSecret, vAddresses[2].scan_pubkey, vAddresses[2].spend_pubkey, shared, pkPaid) == 0);
+
+    vector<ec_secret> vShared;
+    vector<ec_point> vPk;
+    BOOST_CHECK(StealthSecretBatch(ephemPubkey, vScanKeys, vShared, vPk) == 0);
+    BOOST_CHECK_EQUAL(vPk.size(), vScanKeys.size());
+    for (unsigned int i = 0; i < vPk.size(); i++)
+        BOOST_CHECK_EQUAL(vPk[i] == pkPaid, i == 2);
+    BOOST_CHECK(memcmp(&vShared[2].e[0], &shared.e[0], ec_secret_size) == 0);
+
+    // not a point
+    ec_point vchBad(ec_compressed_size, 0x05);
+    BOOST_CHECK(StealthSecretBatch(vchBad, vScanKeys, vShared, vPk) != 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
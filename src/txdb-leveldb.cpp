@@ -26,10 +26,36 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Read-through cache of unspent outputs, shared by all CTxDB instances.
+// Entries are dropped whenever their record is written or erased.
+static CCriticalSection cs_coinsCache;
+static map<uint256, CCoins> mapCoinsCache;
+static size_t nCoinsCacheUsage = 0;
+static size_t nCoinsCacheLimit = 0;
+
+static size_t CoinsCacheUsage(const CCoins& coins)
+{
+    size_t nUsage = sizeof(pair<const uint256, CCoins>) + 4 * sizeof(void*) + coins.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxOut& txout, coins.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+static void UncacheCoins(const uint256& hash)
+{
+    map<uint256, CCoins>::iterator mi = mapCoinsCache.find(hash);
+    if (mi == mapCoinsCache.end())
+        return;
+    nCoinsCacheUsage -= CoinsCacheUsage(mi->second);
+    mapCoinsCache.erase(mi);
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
+    // -dbcache is split evenly between the leveldb block cache and the coins cache
     int nCacheSizeMB = GetArg("-dbcache", 100);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    nCoinsCacheLimit = (size_t)nCacheSizeMB * 1048576 / 2;
+    options.block_cache = leveldb::NewLRUCache((size_t)nCacheSizeMB * 1048576 / 2);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     return options;
 }
@@ -131,6 +157,11 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    setBatchCoins.clear();
+
+    LOCK(cs_coinsCache);
+    mapCoinsCache.clear();
+    nCoinsCacheUsage = 0;
 }
 
 bool CTxDB::TxnBegin()
@@ -146,6 +177,13 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    if (!setBatchCoins.empty())
+    {
+        LOCK(cs_coinsCache);
+        BOOST_FOREACH(const uint256& hash, setBatchCoins)
+            UncacheCoins(hash);
+        setBatchCoins.clear();
+    }
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
@@ -280,6 +318,65 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    // Pending changes are only visible through the batch
+    if (setBatchCoins.count(hash))
+        return Read(make_pair(string("coins"), hash), coins);
+
+    // Hold the lock across the read so a concurrent write can't be
+    // overtaken by a stale insert
+    LOCK(cs_coinsCache);
+    map<uint256, CCoins>::iterator mi = mapCoinsCache.find(hash);
+    if (mi != mapCoinsCache.end())
+    {
+        coins = mi->second;
+        return true;
+    }
+    if (!Read(make_pair(string("coins"), hash), coins))
+        return false;
+
+    while (!mapCoinsCache.empty() && nCoinsCacheUsage + CoinsCacheUsage(coins) > nCoinsCacheLimit)
+    {
+        // Evict a random entry
+        mi = mapCoinsCache.lower_bound(GetRandHash());
+        if (mi == mapCoinsCache.end())
+            mi = mapCoinsCache.begin();
+        UncacheCoins(mi->first);
+    }
+    mapCoinsCache.insert(make_pair(hash, coins));
+    nCoinsCacheUsage += CoinsCacheUsage(coins);
+    return true;
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    if (!Write(make_pair(string("coins"), hash), coins))
+        return false;
+    if (activeBatch)
+        setBatchCoins.insert(hash);
+    else
+    {
+        LOCK(cs_coinsCache);
+        UncacheCoins(hash);
+    }
+    return true;
+}
+
+bool CTxDB::EraseCoins(uint256 hash)
+{
+    if (!Erase(make_pair(string("coins"), hash)))
+        return false;
+    if (activeBatch)
+        setBatchCoins.insert(hash);
+    else
+    {
+        LOCK(cs_coinsCache);
+        UncacheCoins(hash);
+    }
+    return true;
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
@@ -418,7 +515,11 @@ bool CTxDB::LoadBlockIndex()
     if (!ReadHashBestChain(hashBestChain))
     {
         if (pindexGenesisBlock == NULL)
+        {
+            // A new database keeps its coins records from the start
+            Write(string("coinsindex"), 1);
             return true;
+        }
         return error("CTxDB::LoadBlockIndex() : hashBestChain not loaded");
     }
     if (!mapBlockIndex.count(hashBestChain))
@@ -431,6 +532,10 @@ bool CTxDB::LoadBlockIndex()
       hashBestChain.ToString(), nBestHeight, CBigNum(nBestChainTrust).ToString(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
 
+    // Databases from before the coins records need them built once
+    if (!Exists(string("coinsindex")) && !BuildCoinsIndex())
+        return error("CTxDB::LoadBlockIndex() : building the coins index failed");
+
     // Load bnBestInvalidTrust, OK if it doesn't exist
     CBigNum bnBestInvalidTrust;
     ReadBestInvalidTrust(bnBestInvalidTrust);
@@ -566,3 +671,51 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+bool CTxDB::BuildCoinsIndex()
+{
+    LogPrintf("Building coins index...\n");
+    int64_t nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
+
+    // Walk the best chain and record every transaction that still has
+    // unspent outputs
+    if (!TxnBegin())
+        return false;
+    for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+    {
+        boost::this_thread::interruption_point();
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            TxnAbort();
+            return error("BuildCoinsIndex() : block.ReadFromDisk failed at %d", pindex->nHeight);
+        }
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (!ReadTxIndex(hashTx, txindex) || txindex.pos.nFile != pindex->nFile || txindex.pos.nBlockPos != pindex->nBlockPos)
+                continue; // indexed in another block, e.g. a duplicate
+
+            CCoins coins(tx, pindex->nHeight, pindex->nTime);
+            coins.Spend(txindex);
+            if (coins.IsPruned())
+                continue;
+            WriteCoins(hashTx, coins);
+            if (++nRecords % 10000 == 0)
+            {
+                if (!TxnCommit() || !TxnBegin())
+                    return error("BuildCoinsIndex() : batch commit failed");
+            }
+        }
+        if (pindex == pindexBest)
+            break;
+    }
+    Write(string("coinsindex"), 1);
+    if (!TxnCommit())
+        return error("BuildCoinsIndex() : batch commit failed");
+
+    LogPrintf("Built coins index of %u transactions in %dms\n", nRecords, GetTimeMillis() - nStart);
+    return true;
+}
@@ -9,6 +9,7 @@
 #include "main.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -50,6 +51,10 @@ private:
     bool fReadOnly;
     int nVersion;
 
+    // Coins written into activeBatch; they bypass the coins cache until the
+    // batch is committed.
+    std::set<uint256> setBatchCoins;
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
@@ -169,6 +174,7 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        setBatchCoins.clear();
         return true;
     }
 
@@ -194,6 +200,9 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool EraseCoins(uint256 hash);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
@@ -202,6 +211,7 @@ public:
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool BuildCoinsIndex();
 };
 
 
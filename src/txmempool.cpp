@@ -3,14 +3,79 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
-#include "chain.h"
 #include "txmempool.h"
-#include "main.h" // for CTransaction
 
 using namespace std;
 
+// After evicting, halve the minimum fee rate this often (in seconds)
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+// Rough heap size of a std::map or std::set node holding a T: the value
+// plus the tree's parent/left/right pointers and color
+template<typename T>
+static size_t TreeNodeUsage()
+{
+    return sizeof(T) + 4 * sizeof(void*);
+}
+
+// A parent/child link is a node in the parent's setChildren and one in the
+// child's setParents
+static size_t LinkUsage()
+{
+    return 2 * TreeNodeUsage<uint256>();
+}
+
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0;
+    nTxSize = 0;
+    nValueIn = 0;
+    nValueInChain = 0;
+    dPriority = 0.0;
+    nHeight = 0;
+    nTime = 0;
+    nUsageSize = 0;
+    nFeesWithDescendants = 0;
+    nSizeWithDescendants = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                                 double dPriorityIn, unsigned int nHeightIn, int64_t nTimeIn)
+    : tx(txIn), nFee(nFeeIn), nValueIn(nValueInIn), nValueInChain(nValueInChainIn),
+      dPriority(dPriorityIn), nHeight(nHeightIn), nTime(nTimeIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = TreeNodeUsage<pair<const uint256, CTxMemPoolEntry> >() +
+                 TransactionUsage(tx) +
+                 tx.vin.size() * TreeNodeUsage<pair<const COutPoint, CInPoint> >() +
+                 2 * TreeNodeUsage<pair<double, uint256> >();
+    nFeesWithDescendants = nFee;
+    nSizeWithDescendants = nTxSize;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurrentHeight) const
+{
+    if (nCurrentHeight <= nHeight)
+        return dPriority;
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nUsage = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,16 +90,114 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// Requires cs. All in-pool transactions hash spends from, directly or not.
+void CTxMemPool::CalculateAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(vWork.back());
+        vWork.pop_back();
+        if (mi == mapTx.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashParent, mi->second.setParents)
+            if (setAncestors.insert(hashParent).second)
+                vWork.push_back(hashParent);
+    }
+}
+
+// Requires cs.
+void CTxMemPool::SetDescendantState(CTxMemPoolEntry& entry, const uint256& hash, int64_t nFees, uint64_t nSize)
+{
+    setTxByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+    entry.nFeesWithDescendants = nFees;
+    entry.nSizeWithDescendants = nSize;
+    setTxByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hash));
+}
+
+// Requires cs. Count the descendants of hash again from scratch, for when
+// links other than to a leaf were added or removed.
+void CTxMemPool::UpdateDescendantState(const uint256& hash)
+{
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+    int64_t nFees = mi->second.nFee;
+    uint64_t nSize = mi->second.nTxSize;
+    set<uint256> setDescendants;
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        const CTxMemPoolEntry& entry = mapTx[vWork.back()];
+        vWork.pop_back();
+        BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+        {
+            if (!setDescendants.insert(hashChild).second)
+                continue;
+            const CTxMemPoolEntry& child = mapTx[hashChild];
+            nFees += child.nFee;
+            nSize += child.nTxSize;
+            vWork.push_back(hashChild);
+        }
+    }
+    SetDescendantState(mi->second, hash, nFees, nSize);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        CTxMemPoolEntry& newentry = mapTx[hash] = entry;
+        CTransaction& tx = newentry.tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+
+            // Link to parents still waiting in the pool
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(tx.vin[i].prevout.hash);
+            if (mi != mapTx.end())
+            {
+                newentry.setParents.insert(mi->first);
+                mi->second.setChildren.insert(hash);
+            }
+        }
+        // Children can only be in the pool already after a reorganization
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it != mapNextTx.end())
+            {
+                uint256 hashChild = it->second.ptx->GetHash();
+                newentry.setChildren.insert(hashChild);
+                mapTx[hashChild].setParents.insert(hash);
+            }
+        }
+        setTxByFeeRate.insert(make_pair(newentry.GetFeeRate(), hash));
+        setTxByDescendantScore.insert(make_pair(newentry.GetDescendantScore(), hash));
+        nUsage += newentry.DynamicMemoryUsage() + (newentry.setParents.size() + newentry.setChildren.size()) * LinkUsage();
+
+        // Its ancestors now also pay for it, and after a reorganization for
+        // the children it already has
+        set<uint256> setAncestors;
+        CalculateAncestors(hash, setAncestors);
+        if (newentry.setChildren.empty())
+        {
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+                SetDescendantState(ancestor, hashAncestor, ancestor.nFeesWithDescendants + newentry.nFee,
+                                   ancestor.nSizeWithDescendants + newentry.nTxSize);
+            }
+        }
+        else
+        {
+            UpdateDescendantState(hash);
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -46,7 +209,8 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -55,15 +219,65 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                         remove(*it->second.ptx, true);
                 }
             }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            const CTxMemPoolEntry& entry = mi->second;
+            set<uint256> setAncestors;
+            CalculateAncestors(hash, setAncestors);
+            int64_t nFee = entry.nFee;
+            unsigned int nTxSize = entry.nTxSize;
+            bool fHasChildren = !entry.setChildren.empty();
+
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+                mapTx[hashParent].setChildren.erase(hash);
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+                mapTx[hashChild].setParents.erase(hash);
+            BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            setTxByFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+            setTxByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+            nUsage -= entry.DynamicMemoryUsage() + (entry.setParents.size() + entry.setChildren.size()) * LinkUsage();
+            mapTx.erase(mi);
+
+            // Its ancestors no longer pay for it, nor for children it leaves behind
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                if (fHasChildren)
+                    UpdateDescendantState(hashAncestor);
+                else
+                {
+                    CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+                    SetDescendantState(ancestor, hashAncestor, ancestor.nFeesWithDescendants - nFee,
+                                       ancestor.nSizeWithDescendants - nTxSize);
+                }
+            }
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+void CTxMemPool::removeConfirmed(const CTransaction &tx, unsigned int nBlockHeight)
+{
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+
+    // What its children spend from it is in the chain now, and gains
+    // priority from nBlockHeight on
+    BOOST_FOREACH(const uint256& hashChild, mi->second.setChildren)
+    {
+        CTxMemPoolEntry& child = mapTx[hashChild];
+        int64_t nValue = 0;
+        BOOST_FOREACH(const CTxIn& txin, child.tx.vin)
+            if (txin.prevout.hash == hash)
+                nValue += tx.vout[txin.prevout.n].nValue;
+        child.nValueInChain += nValue;
+        child.dPriority += (double)nValue * (1.0 + (double)child.nHeight - (double)nBlockHeight) / child.nTxSize;
+    }
+    remove(tx);
+}
+
 bool CTxMemPool::removeConflicts(const CTransaction &tx)
 {
     // Remove transactions which depend on inputs of tx, recursively
@@ -84,24 +298,83 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setTxByFeeRate.clear();
+    setTxByDescendantScore.clear();
+    nUsage = 0;
     ++nTransactionsUpdated;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nRemoved = 0;
+    while (!setTxByDescendantScore.empty() && nUsage > nSizeLimit)
+    {
+        // Raise the minimum fee above what the evicted transaction paid,
+        // with its descendants if they paid more, so it cannot come straight back in
+        const pair<double, uint256>& worst = *setTxByDescendantScore.begin();
+        dRollingMinimumFeeRate = max(dRollingMinimumFeeRate, worst.first + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+
+        // Its descendants cannot be mined without it
+        CTransaction tx = mapTx[worst.second].GetTx();
+        unsigned int nSizeBefore = mapTx.size();
+        remove(tx, true);
+        nRemoved += nSizeBefore - mapTx.size();
+    }
+    if (nRemoved > 0)
+        LogPrint("mempool", "TrimToSize : removed %u transactions, minimum fee rate now %.0f\n", nRemoved, dRollingMinimumFeeRate);
+}
+
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (dRollingMinimumFeeRate == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster the emptier the pool is
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return max((int64_t)ceil(dRollingMinimumFeeRate), MIN_RELAY_TX_FEE);
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->second.GetTx();
     return true;
 }
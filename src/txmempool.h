@@ -5,7 +5,60 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
-#include "chain.h"
+#include "main.h"
+
+/** A transaction in the memory pool, with the data block assembly needs
+ *  computed once when it is accepted instead of on every block template.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64_t nFee;              // Cached to avoid expensive parent-transaction lookups
+    unsigned int nTxSize;      // ... and avoid recomputing tx size
+    int64_t nValueIn;          // Sum of all input values
+    int64_t nValueInChain;     // Part of nValueIn spent from transactions already in the chain
+    double dPriority;          // Priority when entering the memory pool
+    unsigned int nHeight;      // Chain height when entering the memory pool
+    int64_t nTime;             // Local time when entering the memory pool
+    size_t nUsageSize;         // Approximate heap usage of the entry and its pool indexes
+    int64_t nFeesWithDescendants;       // Fees of this transaction and all in-pool transactions spending it
+    uint64_t nSizeWithDescendants;      // ... and their total size
+
+    friend class CTxMemPool;
+
+public:
+    std::set<uint256> setParents;   // Memory pool transactions this one spends from
+    std::set<uint256> setChildren;  // Memory pool transactions spending this one
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                    double dPriorityIn, unsigned int nHeightIn, int64_t nTimeIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    int64_t GetValueIn() const { return nValueIn; }
+    unsigned int GetHeight() const { return nHeight; }
+    int64_t GetTime() const { return nTime; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    // Fee per 1000 bytes, not rounded like GetMinFee()
+    double GetFeeRate() const { return double(nFee) / (double(nTxSize) / 1000.0); }
+
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+
+    // The better of its own fee rate and that of it with its descendants,
+    // so a parent paid for by its children is evicted with them
+    double GetDescendantScore() const
+    {
+        return std::max(GetFeeRate(), double(nFeesWithDescendants) / (double(nSizeWithDescendants) / 1000.0));
+    }
+
+    // Priority at entry plus the coin age its confirmed inputs gained since
+    double GetPriority(unsigned int nCurrentHeight) const;
+};
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -16,27 +69,54 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Besides the lookup by hash, entries are kept ordered by fee rate in
+ * setTxByFeeRate and by descendant score in setTxByDescendantScore, and
+ * link to their in-pool parents and children. Every entry tracks the fees
+ * and size of itself with all its in-pool descendants.
+ *
+ * Memory use is capped by TrimToSize(): the transactions with the lowest
+ * descendant score are evicted together with everything spending them,
+ * and the fee rate they paid becomes a minimum fee for new transactions
+ * (GetMinFee) that decays again while the pool stays below its limit.
  */
 class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    size_t nUsage;                      // Sum of the entries' DynamicMemoryUsage()
+    mutable double dRollingMinimumFeeRate;  // Fee per 1000 bytes, see GetMinFee()
+    mutable int64_t nLastRollingFeeUpdate;
+
+    void CalculateAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void SetDescendantState(CTxMemPoolEntry& entry, const uint256& hash, int64_t nFees, uint64_t nSize);
+    void UpdateDescendantState(const uint256& hash);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::set<std::pair<double, uint256> > setTxByFeeRate;
+    std::set<std::pair<double, uint256> > setTxByDescendantScore;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
+    // Remove a transaction mined in the block at nBlockHeight
+    void removeConfirmed(const CTransaction &tx, unsigned int nBlockHeight);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    // Evict the lowest descendant score transactions until memory use is below nSizeLimit bytes
+    void TrimToSize(size_t nSizeLimit);
+    // Fee per 1000 bytes new transactions must pay after the pool had to evict
+    int64_t GetMinFee(size_t nSizeLimit) const;
+    size_t DynamicMemoryUsage() const;
+
     unsigned long size() const
     {
         LOCK(cs);
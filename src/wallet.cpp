@@ -5,12 +5,14 @@
 
 #include "wallet.h"
 #include "base58.h"
+#include "init.h"
 #include "blockparams.h"
 #include "coincontrol.h"
 #include "kernel.h"
 #include "net.h"
 #include "util.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "walletdb.h"
 #include "crypter.h"
@@ -189,8 +191,19 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     return true;
 }
 
+// Keys and scripts the wallet file sorts after its transactions ("wkey",
+// "watchs") change which outputs of the loaded transactions are ours
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!mapWallet.empty())
+        fUnspentTxsStale = true;
+    return CCryptoKeyStore::AddKeyPubKey(key, pubkey);
+}
+
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
+    if (!mapWallet.empty())
+        fUnspentTxsStale = true;
     return CCryptoKeyStore::AddWatchOnly(dest);
 }
 
@@ -326,8 +339,46 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    LOCK(cs_wallet);
+
+    // A running rescan records how far it got instead
+    if (!fScanningWallet)
+    {
+        CWalletDB walletdb(strWalletFile);
+        walletdb.WriteBestBlock(loc);
+    }
+
+    // Candidates stay cached across blocks; drop those reorganized away
+    map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.begin();
+    while (mi != mapStakeCandidates.end())
+    {
+        if ((*mi).second.IsValid())
+            mi++;
+        else
+            mapStakeCandidates.erase(mi++);
+    }
+}
+
+bool CWallet::GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate)
+{
+    LOCK(cs_wallet);
+    map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.find(prevout);
+    if (mi != mapStakeCandidates.end())
+    {
+        if ((*mi).second.IsValid())
+        {
+            candidate = (*mi).second;
+            return true;
+        }
+        mapStakeCandidates.erase(mi);
+    }
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(prevout.hash);
+    if (!::GetStakeCandidate(txdb, prevout, candidate, it != mapWallet.end() ? (*it).second.hashBlock : 0))
+        return false;
+
+    mapStakeCandidates.insert(make_pair(prevout, candidate));
+    return true;
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -446,6 +497,57 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+// An output of ours stays in the index until it is marked spent and a
+// transaction spending it is in the main chain, which only a reorg undoes
+bool CWallet::HasUnspentOutputs(const CWalletTx& wtx) const
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        if (!wtx.IsSpent(i))
+            return true;
+
+        bool fSpentInChain = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(wtx.GetHash(), i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpentInChain; ++it)
+        {
+            map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpentInChain = mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0;
+        }
+        if (!fSpentInChain)
+            return true;
+    }
+    return false;
+}
+
+void CWallet::UpdateUnspentTxs(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    if (fUnspentTxsStale)
+        return;
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end() && HasUnspentOutputs(mi->second))
+        mapUnspentTxs[hash] = &mi->second;
+    else
+        mapUnspentTxs.erase(hash);
+}
+
+const CWallet::UnspentTxs& CWallet::GetUnspentTxs() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fUnspentTxsStale)
+    {
+        mapUnspentTxs.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            if (HasUnspentOutputs(it->second))
+                mapUnspentTxs.insert(mapUnspentTxs.end(), make_pair(it->first, &it->second));
+        fUnspentTxsStale = false;
+    }
+    return mapUnspentTxs;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -596,6 +698,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // Imported keys and scripts change which outputs are ours
+        fUnspentTxsStale = true;
     }
 }
 
@@ -609,6 +713,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+
+        // Its outputs, and the coins it spends that were loaded before it
+        LOCK(cs_wallet);
+        UpdateUnspentTxs(hash);
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            UpdateUnspentTxs(txin.prevout.hash);
     }
     else
     {
@@ -677,6 +787,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
                 wtx.hashBlock = wtxIn.hashBlock;
+                // In a block, it no longer needs its supporting transactions
+                vector<CMerkleTx>().swap(wtx.vtxPrev);
                 fUpdated = true;
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -704,6 +816,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
+        // Its outputs, and once it is in a block the coins it spends
+        UpdateUnspentTxs(hash);
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            UpdateUnspentTxs(txin.prevout.hash);
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -764,10 +881,14 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
     {
         if (mapWallet.count(txin.prevout.hash))
             mapWallet[txin.prevout.hash].MarkDirty();
+        mapStakeCandidates.erase(txin.prevout);
     }
 
     if (!fConnect)
     {
+        // Spends of our coins may have left the main chain
+        fUnspentTxsStale = true;
+
         // wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -789,6 +910,7 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
             coin.BindWallet(this);
             coin.MarkSpent(txin.prevout.n);
             coin.WriteToDisk();
+            UpdateUnspentTxs(txin.prevout.hash);
             NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
         }
     }
@@ -801,7 +923,10 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
+            mapUnspentTxs.erase(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1063,35 +1188,252 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Blocks read and matched ahead of the one being added to the wallet
+static const unsigned int RESCAN_BLOCKS_AHEAD = 256;
+// Most blocks added to the wallet per hold of cs_main and cs_wallet
+static const unsigned int RESCAN_BLOCKS_PER_LOCK = 64;
+
+// Whether a rescan has to look at tx under the wallet lock: it pays a key or
+// script of ours, or carries an ephemeral key a stealth address may match.
+// Spends of wallet transactions are found there, in chain order.
+static bool RescanMatch(const CWallet* pwallet, const CTransaction& tx)
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        if (pwallet->IsMine(txout) != ISMINE_NO)
+            return true;
+
+        CScript::const_iterator pc = txout.scriptPubKey.begin();
+        opcodetype opcode;
+        vector<unsigned char> vch;
+        if (txout.scriptPubKey.GetOp(pc, opcode, vch) && opcode == OP_RETURN
+            && txout.scriptPubKey.GetOp(pc, opcode, vch) && vch.size() == 33)
+            return true;
+    }
+    return false;
+}
+
+// The scanning thread queues main chain blocks, -par threads read them and
+// match their transactions against the keystore, and the scanning thread
+// adds the matches to the wallet in chain order
+class CWalletRescan
+{
+public:
+    struct CRescanBlock
+    {
+        CBlockIndex* pindex;
+        CBlock block;
+        std::vector<bool> vMatch; // per transaction, see RescanMatch
+    };
+
+    const CWallet* pwallet;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<unsigned int, CBlockIndex*> > queueRead;
+    std::map<unsigned int, boost::shared_ptr<CRescanBlock> > mapMatched;
+    unsigned int nQueued; // blocks queued so far
+    unsigned int nTaken;  // blocks taken by the scanning thread so far
+    bool fStop;
+
+    CWalletRescan(const CWallet* pwalletIn) : pwallet(pwalletIn), nQueued(0), nTaken(0), fStop(false) {}
+
+    void Queue(CBlockIndex* pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueRead.push_back(std::make_pair(nQueued++, pindex));
+        cond.notify_all();
+    }
+
+    unsigned int Ahead()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nQueued - nTaken;
+    }
+
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+
+    void ThreadMatch()
+    {
+        while (true)
+        {
+            std::pair<unsigned int, CBlockIndex*> item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRead.empty() && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                item = queueRead.front();
+                queueRead.pop_front();
+            }
+
+            boost::shared_ptr<CRescanBlock> prescan(new CRescanBlock());
+            prescan->pindex = item.second;
+            if (!prescan->block.ReadFromDisk(item.second, true))
+                prescan->block.SetNull();
+            prescan->vMatch.reserve(prescan->block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, prescan->block.vtx)
+                prescan->vMatch.push_back(RescanMatch(pwallet, tx));
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapMatched[item.first] = prescan;
+            cond.notify_all();
+        }
+    }
+
+    // The next queued block in order, or NULL if nothing is queued or,
+    // without fWait, it isn't matched yet
+    boost::shared_ptr<CRescanBlock> Next(bool fWait)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true)
+        {
+            std::map<unsigned int, boost::shared_ptr<CRescanBlock> >::iterator it = mapMatched.find(nTaken);
+            if (it != mapMatched.end())
+            {
+                boost::shared_ptr<CRescanBlock> prescan = it->second;
+                mapMatched.erase(it);
+                nTaken++;
+                return prescan;
+            }
+            if (!fWait || nTaken == nQueued)
+                return boost::shared_ptr<CRescanBlock>();
+            cond.wait(lock);
+        }
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// cs_main and cs_wallet are taken for a batch of blocks at a time, so the
+// caller must not hold them for the node to keep running. Until the scan
+// reaches the tip the wallet's best block records how far it got, so a
+// restart resumes it.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    if (!pindexStart)
+        return ret;
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = GetTime();
+    int nStartHeight = pindexStart->nHeight;
+    uint32_t nFoundStealthStart = nFoundStealth;
 
-    CBlockIndex* pindex = pindexStart;
     {
-        LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        LOCK(cs_wallet);
+        fScanningWallet = true;
+    }
+    ShowProgress(_("Rescanning..."), 0); // show progress dialog in GUI
+
+    CWalletRescan rescan(this);
+    boost::thread_group threads;
+    int nMatchThreads = max(nScriptCheckThreads, 1);
+    for (int i = 0; i < nMatchThreads; i++)
+        threads.create_thread(boost::bind(&CWalletRescan::ThreadMatch, &rescan));
+
+    CBlockIndex* pindexQueue = pindexStart;
+    CBlockIndex* pindexLastQueued = NULL;
+    CBlockIndex* pindexScanned = NULL;
+    try {
+        while (!ShutdownRequested())
         {
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
+            {
+                LOCK(cs_main);
+                // Follow blocks connected since, or go back to the fork
+                // after a reorganization
+                if (!pindexQueue && pindexLastQueued)
+                {
+                    while (!pindexLastQueued->IsInMainChain())
+                        pindexLastQueued = pindexLastQueued->pprev;
+                    pindexQueue = pindexLastQueued->pnext;
+                }
+                while (pindexQueue && rescan.Ahead() < RESCAN_BLOCKS_AHEAD)
+                {
+                    // no need to read and scan block, if block was created before
+                    // our wallet birthday (as adjusted for block time variability)
+                    if (!nTimeFirstKey || pindexQueue->nTime >= nTimeFirstKey - 7200)
+                        rescan.Queue(pindexQueue);
+                    pindexLastQueued = pindexQueue;
+                    pindexQueue = pindexQueue->pnext;
+                }
+            }
+
+            boost::shared_ptr<CWalletRescan::CRescanBlock> prescan = rescan.Next(true);
+            if (!prescan)
+                break;
+
+            {
+                LOCK2(cs_main, cs_wallet);
+                for (unsigned int nBlocks = 0; prescan && nBlocks < RESCAN_BLOCKS_PER_LOCK; nBlocks++)
+                {
+                    // Blocks reorganized away are queued again from the fork
+                    if (prescan->pindex->IsInMainChain())
+                    {
+                        const CBlock& block = prescan->block;
+                        for (unsigned int i = 0; i < block.vtx.size(); i++)
+                        {
+                            const CTransaction& tx = block.vtx[i];
+                            // A stealth payment found added a key the
+                            // matching threads may not have seen
+                            bool fCheck = prescan->vMatch[i] || nFoundStealth != nFoundStealthStart || mapWallet.count(tx.GetHash());
+                            for (unsigned int j = 0; j < tx.vin.size() && !fCheck; j++)
+                                fCheck = mapWallet.count(tx.vin[j].prevout.hash);
+                            if (fCheck && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                                ret++;
+                        }
+                        pindexScanned = prescan->pindex;
+                    }
+                    prescan = rescan.Next(false);
+                }
             }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            if (pindexScanned)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                ShowProgress("", std::max(1, std::min(99, (int)((pindexScanned->nHeight - nStartHeight) * 100 / std::max(1, nBestHeight - nStartHeight)))));
+                if (GetTime() >= nLastProgress + 60)
+                {
+                    nLastProgress = GetTime();
+                    LogPrintf("Still rescanning. At block %d.\n", pindexScanned->nHeight);
+                    if (fFileBacked)
+                        CWalletDB(strWalletFile).WriteBestBlock(CBlockLocator(pindexScanned));
+                }
             }
-            pindex = pindex->pnext;
         }
     }
+    catch (...) {
+        rescan.Stop();
+        threads.interrupt_all();
+        threads.join_all();
+        LOCK(cs_wallet);
+        fScanningWallet = false;
+        throw;
+    }
+    rescan.Stop();
+    threads.interrupt_all();
+    threads.join_all();
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        fScanningWallet = false;
+        if (fFileBacked)
+        {
+            // Interrupted by shutdown: the next start rescans from here
+            if (ShutdownRequested())
+                CWalletDB(strWalletFile).WriteBestBlock(CBlockLocator(pindexScanned ? pindexScanned : pindexStart->pprev ? pindexStart->pprev : pindexStart));
+            else
+                CWalletDB(strWalletFile).WriteBestBlock(CBlockLocator(pindexBest));
+        }
+    }
+    ShowProgress("", 100); // hide progress dialog in GUI
+
+    LogPrint("wallet", "Rescan from block %d found %d transactions in %dms\n", nStartHeight, ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -1101,62 +1443,76 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK2(cs_main, cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
-            const uint256& wtxid = item.first;
-            CWalletTx& wtx = item.second;
-            assert(wtx.GetHash() == wtxid);
-
-            int nDepth = wtx.GetDepthInMainChain();
-
-            if (!wtx.IsCoinBase() && nDepth < 0)
-            {
-                // Try to add to memory pool
-                LOCK(mempool.cs);
-                wtx.AcceptToMemoryPool(false);
-            }
-            if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                continue;
-            }
+                const uint256& wtxid = item.first;
+                CWalletTx& wtx = item.second;
+                assert(wtx.GetHash() == wtxid);
 
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
-            {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
+                int nDepth = wtx.GetDepthInMainChain();
+
+                if (!wtx.IsCoinBase() && nDepth < 0)
+                {
+                    // Try to add to memory pool
+                    LOCK(mempool.cs);
+                    wtx.AcceptToMemoryPool(false);
+                }
+                if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
                 {
-                    LogPrintf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %u != wtx.vout.size() %u\n", txindex.vSpent.size(), wtx.vout.size());
                     continue;
                 }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+
+                // In the chain with every output of ours spent, there is no
+                // spent state to update: skip reading its tx index
+                if (nDepth > 0)
+                {
+                    bool fAllSpent = true;
+                    for (unsigned int i = 0; i < wtx.vout.size() && fAllSpent; i++)
+                        fAllSpent = wtx.IsSpent(i) || IsMine(wtx.vout[i]) == ISMINE_NO;
+                    if (fAllSpent)
+                        continue;
+                }
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        LogPrintf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %u != wtx.vout.size() %u\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
+                    {
+                        LogPrintf("ReacceptWalletTransactions found spent coin %s ZLM %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
+                        UpdateUnspentTxs(wtxid);
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    LogPrintf("ReacceptWalletTransactions found spent coin %s ZLM %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Re-accept any txes of ours that aren't already in a block
+                    if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
+                        wtx.AcceptWalletTransaction(txdb);
                 }
             }
-            else
-            {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
-                    wtx.AcceptWalletTransaction(txdb);
-            }
         }
         if (!vMissingTx.empty())
         {
@@ -1265,9 +1621,10 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1281,9 +1638,10 @@ CAmount CWallet::GetStake() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    const UnspentTxs& unspent = GetUnspentTxs();
+    for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
     }
@@ -1294,9 +1652,10 @@ CAmount CWallet::GetNewMint() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    const UnspentTxs& unspent = GetUnspentTxs();
+    for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
     }
@@ -1308,9 +1667,10 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1323,9 +1683,10 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1337,9 +1698,10 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1352,9 +1714,10 @@ CAmount CWallet::GetWatchOnlyStake() const
 {
     CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    const UnspentTxs& unspent = GetUnspentTxs();
+    for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = (*it).second;
         if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
     }
@@ -1366,9 +1729,10 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1381,9 +1745,10 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -1397,9 +1762,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1451,9 +1817,10 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1504,9 +1871,10 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
 
             int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < 1)
@@ -1808,9 +2176,10 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const UnspentTxs& unspent = GetUnspentTxs();
+        for (UnspentTxs::const_iterator it = unspent.begin(); it != unspent.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = (*it).second;
             if (pcoin->IsTrusted()){
                 int nDepth = pcoin->GetDepthInMainChain(false);
 
@@ -1968,6 +2337,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateCache();
                 wtxNew.fFromMe = true;
 
                 int64_t nTotalValue = nValue + nFeeRet;
@@ -2647,7 +3017,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     LOCK(cs_wallet);
     ec_secret sSpendR;
     ec_secret sSpend;
-    ec_secret sScan;
     ec_secret sShared;
 
     ec_point pkExtracted;
@@ -2699,6 +3068,17 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
         int32_t nOutputId = -1;
         nStealth++;
+
+        // -- the one-time key of every owned address for this ephemeral
+        //    key, derived once, when the first candidate output needs it
+        const std::vector<CStealthScanKey>& vScanKeys = GetStealthScanKeys();
+        if (vScanKeys.empty())
+            continue;
+        bool fDerived = false;
+        std::vector<ec_secret> vShared;
+        std::vector<ec_point> vPkDerived;
+        std::vector<CKeyID> vKeyIdDerived;
+
         BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
         {
             nOutputId++;
@@ -2721,31 +3101,40 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             if (HaveKey(ckidMatch)) // no point checking if already have key
                 continue;
 
-            std::set<CStealthAddress>::iterator it;
-            for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+            if (!fDerived)
             {
-                if (it->scan_secret.size() != ec_secret_size)
-                    continue; // stealth address is not owned
-
-                //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
-
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
+                if (StealthSecretBatch(vchEphemPK, vScanKeys, vShared, vPkDerived) != 0)
                 {
-                    printf("StealthSecret failed.\n");
-                    continue;
+                    printf("StealthSecretBatch failed.\n");
+                    break;
                 };
-                //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
-
-                CPubKey cpkE(pkExtracted);
+                vKeyIdDerived.resize(vPkDerived.size());
+                for (size_t k = 0; k < vPkDerived.size(); ++k)
+                {
+                    CPubKey cpkE(vPkDerived[k]);
+                    if (cpkE.IsValid())
+                        vKeyIdDerived[k] = cpkE.GetID();
+                    else
+                        vPkDerived[k].clear();
+                };
+                fDerived = true;
+            };
 
-                if (!cpkE.IsValid())
+            for (size_t k = 0; k < vScanKeys.size(); ++k)
+            {
+                if (vPkDerived[k].empty() || vKeyIdDerived[k] != ckidMatch)
                     continue;
-                CKeyID ckidE = cpkE.GetID();
 
-                if (ckidMatch != ckidE)
+                CStealthAddress sxFind;
+                sxFind.scan_pubkey = vScanKeys[k].scan_pubkey;
+                std::set<CStealthAddress>::iterator it = stealthAddresses.find(sxFind);
+                if (it == stealthAddresses.end())
                     continue;
 
+                sShared = vShared[k];
+                pkExtracted = vPkDerived[k];
+                CPubKey cpkE(pkExtracted);
+
                 if (fDebug)
                     printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
@@ -2847,6 +3236,23 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     return true;
 };
 
+const std::vector<CStealthScanKey>& CWallet::GetStealthScanKeys()
+{
+    AssertLockHeld(cs_wallet);
+    if (nStealthScanKeysBuilt != stealthAddresses.size())
+    {
+        vStealthScanKeys.clear();
+        BOOST_FOREACH(const CStealthAddress& sxAddr, stealthAddresses)
+        {
+            CStealthScanKey scanKey;
+            if (StealthScanKey(sxAddr, scanKey) == 0)
+                vStealthScanKeys.push_back(scanKey);
+        }
+        nStealthScanKeysBuilt = stealthAddresses.size();
+    }
+    return vStealthScanKeys;
+}
+
 uint64_t CWallet::GetStakeWeight() const
 {
     // Choose coins to use
@@ -2886,6 +3292,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     txNew.vin.clear();
     txNew.vout.clear();
+    txNew.InvalidateCache();
 
     // Mark coin stake transaction
     CScript scriptEmpty;
@@ -2913,80 +3320,85 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
+
+    vector<pair<const CWalletTx*, unsigned int> > vStakeCoins;
+    vector<CStakeCandidate> vCandidates;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        CStakeCandidate candidate;
+        if (!GetStakeCandidate(txdb, COutPoint(pcoin.first->GetHash(), pcoin.second), candidate))
+            continue;
+        vStakeCoins.push_back(pcoin);
+        vCandidates.push_back(candidate);
+    }
+
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    static int nMaxStakeSearchInterval = 60;
+    size_t nSearchFrom = 0;
+    size_t nKernel;
+    int64_t nTimeKernel;
+    while (SearchStakeKernel(pindexPrev, nBits, txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval), vCandidates, nSearchFrom, nKernel, nTimeKernel))
+    {
+        // Found a kernel
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vStakeCoins[nKernel];
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+
+        // If this kernel cannot be used the search resumes after it
+        nSearchFrom = nKernel + 1;
+
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if(nCredit > GetStakeSplitThreshold())
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if(nCredit > GetStakeSplitThreshold())
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -3288,11 +3700,17 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspentTxs(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
+            // Commit the transaction, its spent coins and the used key together
+            // before it is broadcast
             if (fFileBacked)
+            {
+                bitdb.FlushWrites(strWalletFile);
                 delete pwalletdb;
+            }
         }
 
         // Track how many getdata requests our transaction gets
@@ -3816,6 +4234,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    fUnspentTxsStale = true;
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3851,6 +4270,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspentTxs(txin.prevout.hash);
             }
         }
     }
@@ -4040,11 +4460,11 @@ bool CWallet::ImportPrivateKey(CZalemCoinSecret vchSecret, string strLabel, bool
 
         // whenever a key is imported, we need to scan the whole chain
         nTimeFirstKey = 1; // 0 would be considered 'no value'
+    }
 
-        if (fRescan) {
-            ScanForWalletTransactions(pindexGenesisBlock, true);
-            ReacceptWalletTransactions();
-        }
+    if (fRescan) {
+        ScanForWalletTransactions(pindexGenesisBlock, true);
+        ReacceptWalletTransactions();
     }
 
     return true;
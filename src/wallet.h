@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "crypter.h"
+#include "kernel.h"
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -114,6 +115,33 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Kernel inputs of stakeable outputs, so CreateCoinStake does not go to
+    // disk for every coin on every search round
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate);
+
+    // Wallet transactions that may still have an output of ours unspent, so
+    // balances and coin selection skip the spent history. Entries point into
+    // mapWallet. It is kept up to date as transactions are loaded and added;
+    // a reorg or an import marks it stale and the next reader rebuilds it.
+    typedef std::map<uint256, const CWalletTx*> UnspentTxs;
+    mutable UnspentTxs mapUnspentTxs;
+    mutable bool fUnspentTxsStale;
+    bool HasUnspentOutputs(const CWalletTx& wtx) const;
+    void UpdateUnspentTxs(const uint256& hash);
+    const UnspentTxs& GetUnspentTxs() const;
+
+    // Set while ScanForWalletTransactions runs, which then keeps the best
+    // block written to the wallet at the last block it scanned
+    bool fScanningWallet;
+
+    // Owned stealth addresses parsed for FindStealthTransactions. Addresses
+    // are only added, or replaced with their secrets encrypted or decrypted,
+    // so the keys are rebuilt when the number of addresses changes.
+    std::vector<CStealthScanKey> vStealthScanKeys;
+    size_t nStealthScanKeysBuilt;
+    const std::vector<CStealthScanKey>& GetStealthScanKeys();
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -175,6 +203,9 @@ public:
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fUnspentTxsStale = false;
+        fScanningWallet = false;
+        nStealthScanKeysBuilt = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -220,7 +251,7 @@ public:
     // Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     // Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
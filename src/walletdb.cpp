@@ -67,7 +67,8 @@ bool CWalletDB::WriteStealthAddress(const CStealthAddress& sxAddr)
 {
     nWalletDBUpdated++;
 
-    return Write(std::make_pair(std::string("sxAddr"), sxAddr.scan_pubkey), sxAddr, true);
+    // Holds the address secrets, so isn't left queued
+    return Write(std::make_pair(std::string("sxAddr"), sxAddr.scan_pubkey), sxAddr, true) && FlushWrites();
 }
 
 bool CWalletDB::ReadStealthAddress(CStealthAddress& sxAddr)
@@ -117,7 +118,7 @@ bool CWalletDB::WriteCryptedKey(const CPubKey& vchPubKey,
 bool CWalletDB::WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
 {
     nWalletDBUpdated++;
-    return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true);
+    return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true) && FlushWrites();
 }
 
 bool CWalletDB::WriteCScript(const uint160& hash, const CScript& redeemScript)
@@ -379,6 +380,19 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             if (!(wtx.CheckTransaction() && (wtx.GetHash() == hash)))
                 return false;
 
+            // Supporting transactions are only relayed with a transaction
+            // that isn't in the chain yet. Don't keep them for those that are,
+            // and rewrite the record without them so it loads faster.
+            if (!wtx.vtxPrev.empty() && wtx.hashBlock != 0)
+            {
+                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+                if (mi != mapBlockIndex.end() && mi->second->IsInMainChain())
+                {
+                    vector<CMerkleTx>().swap(wtx.vtxPrev);
+                    wss.vWalletUpgrade.push_back(hash);
+                }
+            }
+
             // Undo serialize changes in 31600
             if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
             {
@@ -754,6 +768,9 @@ void ThreadFlushWalletDB(const string& strFile)
     {
         MilliSleep(500);
 
+        // Commit the writes held for longer than -walletflushinterval together
+        bitdb.FlushWrites(strFile, bitdb.nWriteBehind);
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
@@ -807,7 +824,7 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0)
             {
-                // Flush log data to the dat file
+                // Flush queued writes and log data to the dat file
                 bitdb.CloseDb(wallet.strWalletFile);
                 bitdb.CheckpointLSN(wallet.strWalletFile);
                 bitdb.mapFileUseCount.erase(wallet.strWalletFile);